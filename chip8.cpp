@@ -1,35 +1,85 @@
 #include "chip8.h"
+#include "chip8log.h"
+#include "chip8profile.h"
+
+#include <type_traits>
+
+static_assert(std::is_trivially_copyable<chip8>::value, "chip8 must stay clonable with memcpy");
+
+// Arguments are only evaluated when the level is both compiled in and enabled.
+#define CHIP8_LOG(level, ...) \
+	do { \
+		if ((level) >= CHIP8_LOG_MIN_LEVEL && (logMask & CHIP8_LOG_BIT(level))) \
+		{ \
+			if (logRing != NULL) \
+				logRing->push((level), __VA_ARGS__); \
+			else if (logger != NULL) \
+				logger((level), __VA_ARGS__); \
+		} \
+	} while (0)
+
+// Profile hooks, gone entirely without CHIP8_PROFILE.
+#ifdef CHIP8_PROFILE
+#define CHIP8_PROFILE_COUNT(...) \
+	do { \
+		if (profile != NULL) \
+		{ \
+			__VA_ARGS__; \
+		} \
+	} while (0)
+#else
+#define CHIP8_PROFILE_COUNT(...) do { } while (0)
+#endif
 
 chip8::chip8()
+	: seed(CHIP8_DEFAULT_SEED), logger(NULL), logMask(CHIP8_LOG_DEFAULT_MASK), logRing(NULL), profile(NULL)
 {
 	this->Reset();
 }
 
-chip8::~chip8()
-{
-
-}
-
 void chip8::Reset()
 {
     run = false;
 	pc			= 0x200; // program code starts at 0x200
-	opcode		= 0;
 	I			= 0;				
 	sp			= 0;
 	drawFlag	= false;
     frm = 0; //timer run every 9 cycles
 
 	memset(this->gfx, 0, sizeof(this->gfx)); // black screen
+	dirtyRows = 0xFFFFFFFF;
 	memset(this->stack, 0, sizeof(this->stack)); 
 	memset(this->V, 0, sizeof(this->V));
 	memset(this->memory, 0, sizeof(this->memory));
     memset(this->keypad, 0, sizeof(this->keypad));
     memcpy(memory, chip8_fontset, sizeof(chip8_fontset));
+	memset(this->decoded, 0, sizeof(this->decoded)); // CHIP8_OP_UNDECODED
+	memWriteLo = 0;
+	memWriteHi = sizeof(this->memory);
+	memset(&this->idleProbe, 0, sizeof(this->idleProbe));
+	sideEffects = 0;
 
 	delay_timer = 0;
 	sound_timer = 0;
-	srand(time(NULL));
+	rng = chip8_rng_seed(seed);
+	retiredCount = 0;
+}
+
+void chip8::setSeed(uint32_t seed_)
+{
+	seed = seed_;
+	rng = chip8_rng_seed(seed);
+}
+
+bool chip8::setProfile(chip8_profile *counters)
+{
+#ifdef CHIP8_PROFILE
+	profile = counters;
+	return true;
+#else
+	(void)counters;
+	return false;
+#endif
 }
 
 void chip8::setLogger(void *log_func)
@@ -42,10 +92,10 @@ bool chip8::loadApplication(const void * data_, size_t size)
 	const uint8_t *data = static_cast<const uint8_t*>(data_);
 	if (data != NULL && size <= 0x1000 - 0x200)
 	{
-		for (size_t i = 0; i < size; ++i)
-			this->memory[i + 0x200] = data[i];
+		memcpy(this->memory + 0x200, data, size);
+		invalidateDecode(0x200, size);
 		this->run = true;
-		logger(CHIP8_LOG_INFO, "size %d", size);
+		CHIP8_LOG(CHIP8_LOG_INFO, "size %zu\n", size);
 		return true;
 	}
 
@@ -59,338 +109,671 @@ void chip8::runTimers()
 	if (sound_timer > 0)
 	{
 		if (sound_timer == 1)
-			logger(CHIP8_LOG_INFO, "PIIIIIIIIIIIIIIIIP\n");
+			CHIP8_LOG(CHIP8_LOG_DEBUG, "PIIIIIIIIIIIIIIIIP\n");
 		--sound_timer;
 	}
 }
 
+uint16_t chip8::fetchOpcode(uint16_t addr) const
+{
+	return memory[addr & 0xFFF] << 8 | memory[(addr + 1) & 0xFFF];
+}
+
+void chip8::decode(uint16_t addr, chip8_insn &insn) const
+{
+	decodeOpcode(fetchOpcode(addr), insn);
+}
+
+void chip8::decodeOpcode(uint16_t opcode, chip8_insn &insn)
+{
+	insn.x = (opcode & 0x0F00) >> 8;
+	insn.y = (opcode & 0x00F0) >> 4;
+	insn.n = (opcode & 0x000F);
+	insn.nn = (opcode & 0x00FF);
+	insn.nnn = (opcode & 0x0FFF);
+
+	switch (opcode & 0xF000)
+	{
+	case 0x0000:
+		if (insn.y == 0xC)
+			insn.op = CHIP8_OP_SCHIP;
+		else if (insn.nn == 0xE0)
+			insn.op = CHIP8_OP_CLS;
+		else if (insn.nn == 0xEE)
+			insn.op = CHIP8_OP_RET;
+		else if (insn.nn >= 0xFB)
+			insn.op = CHIP8_OP_SCHIP;
+		else
+			insn.op = CHIP8_OP_UNKNOWN;
+		break;
+	case 0x1000: insn.op = CHIP8_OP_JP; break;
+	case 0x2000: insn.op = CHIP8_OP_CALL; break;
+	case 0x3000: insn.op = CHIP8_OP_SE_BYTE; break;
+	case 0x4000: insn.op = CHIP8_OP_SNE_BYTE; break;
+	case 0x5000: insn.op = CHIP8_OP_SE_REG; break;
+	case 0x6000: insn.op = CHIP8_OP_LD_BYTE; break;
+	case 0x7000: insn.op = CHIP8_OP_ADD_BYTE; break;
+	case 0x8000:
+		switch (insn.n)
+		{
+		case 0x0: insn.op = CHIP8_OP_LD_REG; break;
+		case 0x1: insn.op = CHIP8_OP_OR; break;
+		case 0x2: insn.op = CHIP8_OP_AND; break;
+		case 0x3: insn.op = CHIP8_OP_XOR; break;
+		case 0x4: insn.op = CHIP8_OP_ADD_REG; break;
+		case 0x5: insn.op = CHIP8_OP_SUB; break;
+		case 0x6: insn.op = CHIP8_OP_SHR; break;
+		case 0x7: insn.op = CHIP8_OP_SUBN; break;
+		case 0xE: insn.op = CHIP8_OP_SHL; break;
+		default: insn.op = CHIP8_OP_UNKNOWN;
+		}
+		break;
+	case 0x9000: insn.op = CHIP8_OP_SNE_REG; break;
+	case 0xA000: insn.op = CHIP8_OP_LD_I; break;
+	case 0xB000: insn.op = CHIP8_OP_JP_V0; break;
+	case 0xC000: insn.op = CHIP8_OP_RND; break;
+	case 0xD000: insn.op = CHIP8_OP_DRW; break;
+	case 0xE000:
+		switch (insn.nn)
+		{
+		case 0x9E: insn.op = CHIP8_OP_SKP; break;
+		case 0xA1: insn.op = CHIP8_OP_SKNP; break;
+		default: insn.op = CHIP8_OP_UNKNOWN;
+		}
+		break;
+	default: // 0xF000
+		switch (insn.nn)
+		{
+		case 0x07: insn.op = CHIP8_OP_LD_VX_DT; break;
+		case 0x0A: insn.op = CHIP8_OP_LD_VX_K; break;
+		case 0x15: insn.op = CHIP8_OP_LD_DT_VX; break;
+		case 0x18: insn.op = CHIP8_OP_LD_ST_VX; break;
+		case 0x1E: insn.op = CHIP8_OP_ADD_I; break;
+		case 0x29: insn.op = CHIP8_OP_LD_F; break;
+		case 0x33: insn.op = CHIP8_OP_LD_B; break;
+		case 0x55: insn.op = CHIP8_OP_LD_MEM_VX; break;
+		case 0x65: insn.op = CHIP8_OP_LD_VX_MEM; break;
+		default: insn.op = CHIP8_OP_UNKNOWN;
+		}
+	}
+}
+
+// Drop the cached records for every instruction overlapping [addr, addr + len),
+// wrapping at the end of memory like the writes themselves.
+void chip8::invalidateDecode(uint16_t addr, uint16_t len)
+{
+	++sideEffects;
+	for (size_t i = 0; i <= len; ++i) // starts one byte early, that word overlaps too
+		decoded[(addr + 0xFFF + i) & 0xFFF].op = CHIP8_OP_UNDECODED;
+
+	uint16_t lo = addr;
+	uint16_t hi = addr + len;
+	if (hi > sizeof(memory))
+	{
+		lo = 0;
+		hi = sizeof(memory);
+	}
+	if (memWriteLo == memWriteHi)
+	{
+		memWriteLo = lo;
+		memWriteHi = hi;
+	}
+	else
+	{
+		if (lo < memWriteLo)
+			memWriteLo = lo;
+		if (hi > memWriteHi)
+			memWriteHi = hi;
+	}
+}
+
+bool chip8::takeMemoryWrites(uint16_t &lo, uint16_t &hi)
+{
+	if (memWriteLo == memWriteHi)
+		return false;
+	lo = memWriteLo;
+	hi = memWriteHi;
+	memWriteLo = memWriteHi = 0;
+	return true;
+}
+
+// Idle loops. While runFrame holds the timers the keypad and delay timer are
+// constant, so if a backward jump is reached twice in one burst with the machine
+// in the same state and nothing uncompared happened in between, execution is
+// periodic from there on. Every whole period left in the budget is dropped,
+// which leaves exactly the state running them would have. This covers FX07 /
+// 3XNN / 1NNN timer waits and EX9E / 1NNN key polls alike.
+//
+// Probing every backward jump costs more than it saves on busy loops, so the
+// state is sampled at the first one after each IDLE_PROBE_INTERVAL instructions.
+// Two samples that match are still exact, the period found is just a multiple.
+unsigned chip8::skipIdle(uint16_t jump, uint16_t I, uint16_t sp, unsigned count)
+{
+	idle_probe &p = idleProbe;
+	if (p.count > count && p.jump == jump && p.sideEffects == sideEffects
+		&& p.I == I && p.sp == sp && p.delay_timer == delay_timer && p.sound_timer == sound_timer
+		&& memcmp(p.V, V, sizeof(V)) == 0 && memcmp(p.stack, stack, sizeof(stack)) == 0)
+		count %= p.count - count;
+
+	p.jump = jump;
+	p.I = I;
+	p.sp = sp;
+	memcpy(p.stack, stack, sizeof(stack));
+	memcpy(p.V, V, sizeof(V));
+	p.delay_timer = delay_timer;
+	p.sound_timer = sound_timer;
+	p.sideEffects = sideEffects;
+	p.count = count;
+	p.next = count > IDLE_PROBE_INTERVAL ? count - IDLE_PROBE_INTERVAL : 0;
+	return count;
+}
+
+// The handlers below are written once and built either as a switch (default)
+// or, with CHIP8_THREADED, as threaded code where every handler ends in its own
+// indirect jump to the next one. The two builds behave identically.
+#if defined(CHIP8_THREADED) && defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define OP(name)	op_##name:
+#define NEXT		do { RETIRE(); FETCH(); goto *handlers[insn->op]; } while (0)
+#else
+#undef CHIP8_THREADED
+#define OP(name)	case name:
+#define NEXT		break
+#endif
+
+#define FETCH() \
+	do { \
+		if (!run || count-- == 0) \
+			goto done; \
+		++executed; \
+		pee = pc; \
+		if (INSN_TIMERS) \
+			++frm; \
+		insn = &decoded[pc & 0xFFF]; \
+		if (insn->op == CHIP8_OP_UNDECODED) \
+			decode(pc, *insn); \
+		CHIP8_PROFILE_COUNT(++profile->ops[insn->op]; ++profile->pcHits[pc & 0xFFF]); \
+		x = insn->x; \
+		y = insn->y; \
+	} while (0)
+
+#define RETIRE() \
+	do { \
+		if (INSN_TIMERS && frm >= 9) \
+		{ \
+			runTimers(); \
+			frm = 0; \
+		} \
+		if (pee == pc) \
+		{ \
+			CHIP8_LOG(CHIP8_LOG_INFO, "Infinite loop detected at 0x%X, opcode 0x%X\n", pc, fetchOpcode(pc)); \
+			run = false; \
+		} \
+	} while (0)
+
 void chip8::emulateCycle()
 {
-	if (!run)
-		return;
+	execute<true>(1);
+}
+
+void chip8::emulateCycles(unsigned count)
+{
+	execute<true>(count);
+}
 
-	uint16_t  pee = pc;
-	
-	if (memory[pc] == 0x0 && memory[pc + 1] == 0x0 && memory[pc + 2] == 0x0 && memory[pc + 3] == 0x0)
+void chip8::runFrame(unsigned ipf)
+{
+	execute<false>(ipf);
+	runTimers();
+}
+
+// With INSN_TIMERS the timers tick every 9 instructions as emulateCycles always
+// did, otherwise they are left to the caller. pc, I and sp live in locals for
+// the whole burst, shadowing the members, and are written back on the way out.
+template <bool INSN_TIMERS>
+void chip8::execute(unsigned count)
+{
+	uint16_t pc = this->pc;
+	uint16_t I = this->I;
+	uint16_t sp = this->sp;
+	if (!INSN_TIMERS)
 	{
-		logger(CHIP8_LOG_INFO, "Invalid pc 0x%X\n", pc); //shouldn't happen
-		run = false;
+		idleProbe.count = 0;	// timers and input may have changed since the last burst
+		idleProbe.next = count;
 	}
-	
-	++frm;
+	uint16_t pee;
+	chip8_insn *insn;
+	uint8_t x, y;
+	unsigned executed = 0;
 
-	opcode = memory[pc] << 8 | memory[pc + 1]; // fetch opcode
-	//logger(CHIP8_LOG_INFO, "EMULOOP %d, op 0x%X\n",x++,opcode);		
+#ifdef CHIP8_THREADED
+	static const void * const handlers[] = // in CHIP8_OP order
+	{
+		&&op_CHIP8_OP_UNKNOWN,	// CHIP8_OP_UNDECODED never reaches dispatch
+		&&op_CHIP8_OP_CLS, &&op_CHIP8_OP_RET, &&op_CHIP8_OP_SCHIP,
+		&&op_CHIP8_OP_JP, &&op_CHIP8_OP_CALL,
+		&&op_CHIP8_OP_SE_BYTE, &&op_CHIP8_OP_SNE_BYTE, &&op_CHIP8_OP_SE_REG,
+		&&op_CHIP8_OP_LD_BYTE, &&op_CHIP8_OP_ADD_BYTE,
+		&&op_CHIP8_OP_LD_REG, &&op_CHIP8_OP_OR, &&op_CHIP8_OP_AND, &&op_CHIP8_OP_XOR,
+		&&op_CHIP8_OP_ADD_REG, &&op_CHIP8_OP_SUB, &&op_CHIP8_OP_SHR, &&op_CHIP8_OP_SUBN, &&op_CHIP8_OP_SHL,
+		&&op_CHIP8_OP_SNE_REG, &&op_CHIP8_OP_LD_I, &&op_CHIP8_OP_JP_V0, &&op_CHIP8_OP_RND, &&op_CHIP8_OP_DRW,
+		&&op_CHIP8_OP_SKP, &&op_CHIP8_OP_SKNP,
+		&&op_CHIP8_OP_LD_VX_DT, &&op_CHIP8_OP_LD_VX_K, &&op_CHIP8_OP_LD_DT_VX, &&op_CHIP8_OP_LD_ST_VX,
+		&&op_CHIP8_OP_ADD_I, &&op_CHIP8_OP_LD_F, &&op_CHIP8_OP_LD_B,
+		&&op_CHIP8_OP_LD_MEM_VX, &&op_CHIP8_OP_LD_VX_MEM,
+		&&op_CHIP8_OP_UNKNOWN,
+	};
+	static_assert(sizeof(handlers) / sizeof(handlers[0]) == CHIP8_OP_COUNT, "handler table out of sync with CHIP8_OP");
 
-	switch (opcode & 0xF000) // decode opcode
+	FETCH();
+	goto *handlers[insn->op];
 	{
-	case 0x0000:
-        if ((opcode & 0x00F0) >> 4 == 0xC)
-        {
-            logger(CHIP8_LOG_INFO, "Super chip8 unimplemented!");
-            run = false;
-        }
-		switch (opcode & 0x00FF)
+#else
+	for (;;)
+	{
+		FETCH();
+		switch (insn->op) // dispatch on pre-decoded handler
 		{
-		case 0x00E0: // 00E0: Clears the screen.
-			memset(gfx, 0, sizeof(gfx));
-			pc += 2;
-			drawFlag = true;
-			break;
-		case 0x00EE: // 00EE: Returns from a subroutine.
-            --sp;   //prevent overwrite
-            if (sp < 0)
-            {
-                logger(CHIP8_LOG_INFO, "SP underrun!");
-                run = false;
-            }
-			pc = stack[sp];
-            pc += 2;
-			break;
-        case 0x00FB:
-            logger(CHIP8_LOG_INFO, "Super chip8 unimplemented!");
-            run = false;
-            break;
-        case 0x00FC:
-            logger(CHIP8_LOG_INFO, "Super chip8 unimplemented!");
-            run = false;
-            break;
-        case 0x00FD:
-            logger(CHIP8_LOG_INFO, "Super chip8 unimplemented!");
-            run = false;
-            break;
-        case 0x00FE:
-            logger(CHIP8_LOG_INFO, "Super chip8 unimplemented!");
-            run = false;
-            break;
-        case 0x00FF:
-            logger(CHIP8_LOG_INFO, "Super chip8 unimplemented!");
-            run = false;
-            break;
-		default:
-			logger(CHIP8_LOG_INFO, "Unknown opcode [0x0000]: 0x%X\n", opcode);
+#endif
+	OP(CHIP8_OP_CLS) // 00E0: Clears the screen.
+		++sideEffects;
+		for (unsigned row = 0; row < SCREEN_Y; ++row)
+			if (gfx[row])
+				dirtyRows |= 1u << row;
+		memset(gfx, 0, sizeof(gfx));
+		pc += 2;
+		drawFlag = true;
+		NEXT;
+	OP(CHIP8_OP_RET) // 00EE: Returns from a subroutine.
+		if (sp == 0)
+		{
+			CHIP8_LOG(CHIP8_LOG_WARN, "SP underrun!\n");
 			run = false;
+			goto done;	// pc did not move, which RETIRE would take for an infinite loop
 		}
-		break;
-	case 0x1000: // 1NNN: Jumps to address NNN.
-		pc = (opcode & 0x0FFF);
-		break;
-	case 0x2000: // 2NNN: Calls subroutine at NNN.
+		--sp;   //prevent overwrite
+		pc = stack[sp];
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_SCHIP)
+		CHIP8_LOG(CHIP8_LOG_WARN, "Super chip8 unimplemented!\n");
+		run = false;
+		NEXT;
+	OP(CHIP8_OP_JP) // 1NNN: Jumps to address NNN.
+		pc = insn->nnn;
+		if (!INSN_TIMERS && pc <= pee && count <= idleProbe.next)
+		{
+			unsigned left = skipIdle(pee, I, sp, count);
+			CHIP8_PROFILE_COUNT(profile->idleSkipped += count - left);
+			count = left;
+		}
+		NEXT;
+	OP(CHIP8_OP_CALL) // 2NNN: Calls subroutine at NNN.
 		stack[sp] = pc;
 		++sp;
-        if (sp > 15)
-        {
-            logger(CHIP8_LOG_INFO, "SP overrun!");
-            run = false;
-        }
-        pc = (opcode & 0x0FFF);
-		break;
-	case 0x3000: // 3XNN: Skips the next instruction if VX equals NN. (Usually the next instruction is a jump to skip a code block)
-		if (V[(opcode & 0x0F00) >> 8] == (opcode & 0x00FF))
+		if (sp > 15)
+		{
+			CHIP8_LOG(CHIP8_LOG_WARN, "SP overrun!\n");
+			run = false;
+		}
+		pc = insn->nnn;
+		NEXT;
+	OP(CHIP8_OP_SE_BYTE) // 3XNN: Skips the next instruction if VX equals NN. (Usually the next instruction is a jump to skip a code block)
+		if (V[x] == insn->nn)
 			pc += 4;
-        else
-            pc += 2;
-		break;
-	case 0x4000: // 4XNN: Skips the next instruction if VX doesn't equal NN. (Usually the next instruction is a jump to skip a code block)
-		if (V[(opcode & 0x0F00) >> 8] != (opcode & 0x00FF))
+		else
+			pc += 2;
+		NEXT;
+	OP(CHIP8_OP_SNE_BYTE) // 4XNN: Skips the next instruction if VX doesn't equal NN. (Usually the next instruction is a jump to skip a code block)
+		if (V[x] != insn->nn)
 			pc += 4;
 		else
-            pc += 2;
-		break;
-	case 0x5000: // 5XY0: Skips the next instruction if VX equals VY. (Usually the next instruction is a jump to skip a code block)
-		if (V[(opcode & 0x0F00) >> 8] == V[(opcode & 0x00F0) >> 4])
+			pc += 2;
+		NEXT;
+	OP(CHIP8_OP_SE_REG) // 5XY0: Skips the next instruction if VX equals VY. (Usually the next instruction is a jump to skip a code block)
+		if (V[x] == V[y])
 			pc += 4;
-        else
-            pc += 2;
-		break;
-	case 0x6000: // 6XNN: Sets VX to NN.
-		V[(opcode & 0x0F00) >> 8] = (opcode & 0x00FF);
+		else
+			pc += 2;
+		NEXT;
+	OP(CHIP8_OP_LD_BYTE) // 6XNN: Sets VX to NN.
+		V[x] = insn->nn;
 		pc += 2;
-		break;
-	case 0x7000: // 7XNN: Adds NN to VX.
-		V[(opcode & 0x0F00) >> 8] += (opcode & 0x00FF);
+		NEXT;
+	OP(CHIP8_OP_ADD_BYTE) // 7XNN: Adds NN to VX.
+		V[x] += insn->nn;
 		pc += 2;
-		break;
-	case 0x8000:
-		switch (opcode & 0x000F)
-		{
-		case 0x0000: // 8XY0: Sets VX to the value of VY.
-			V[(opcode & 0x0F00) >> 8] = V[(opcode & 0x00F0) >> 4];
-			pc += 2;
-			break;
-		case 0x0001: // 8XY1: Sets VX to VX or VY. (Bitwise OR operation)
-			V[(opcode & 0x0F00) >> 8] |= V[(opcode & 0x00F0) >> 4];
-			pc += 2;
-			break;
-		case 0x0002: // 8XY2: Sets VX to VX and VY. (Bitwise AND operation)
-			V[(opcode & 0x0F00) >> 8] &= V[(opcode & 0x00F0) >> 4];
-			pc += 2;
-			break;
-		case 0x0003: // 8XY3: Sets VX to VX xor VY.
-			V[(opcode & 0x0F00) >> 8] ^= V[(opcode & 0x00F0) >> 4];
-			pc += 2;
-			break;
-		case 0x0004: // 8XY4: Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there isn't.
-			if (V[(opcode & 0x00F0) >> 4] > (0xFF - V[(opcode & 0x0F00) >> 8]))
-				V[0xF] = 1; //carry
-			else
-				V[0xF] = 0;
-			V[(opcode & 0x0F00) >> 8] += V[(opcode & 0x00F0) >> 4];
-			pc += 2;
-			break;
-		case 0x0005: // 8XY5: VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
-			if (V[(opcode & 0x00F0) >> 4] > V[(opcode & 0x0F00) >> 8])
-				V[0xF] = 0; // borrow
-			else
-				V[0xF] = 1;
-
-			V[(opcode & 0x0F00) >> 8] -= V[(opcode & 0x00F0) >> 4];
-			pc += 2;
-			break;
-		case 0x0006: // 8XY6: Shifts VX right by one. VF is set to the value of the least significant bit of VX before the shift. On current implementations Y is ignored.
-			V[0xF] = V[(opcode & 0x0F00) >> 8] & 0x1;
-			V[(opcode & 0x0F00) >> 8] >>= 1;
-			pc += 2;
-			break;
-		case 0x0007: // 8XY7: Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
-			if (V[(opcode & 0x0F00) >> 8] > V[(opcode & 0x00F0) >> 4])
-				V[0xF] = 0;
-			else
-				V[0xF] = 1;
-
-			V[(opcode & 0x0F00) >> 8] = V[(opcode & 0x00F0) >> 4] - V[(opcode & 0x0F00) >> 8];
-			pc += 2;
-			break;
-		case 0x000E: // 8XYE: Shifts VX left by one. VF is set to the value of the most significant bit of VX before the shift.
-			V[0xF] = (V[(opcode & 0x0F00) >> 8] & 0x80) >> 7; // MSB, 0x80 in binary 0b10000000
-			V[(opcode & 0x0F00) >> 8] <<= 1;
-			pc += 2;
-			break;
-		default:
-			logger(CHIP8_LOG_INFO, "Unknown opcode [0x8000]: 0x%X\n", opcode);
-			run = false;
-		}
-		break;
-	case 0x9000: // 9XY0: Skips the next instruction if VX doesn't equal VY. (Usually the next instruction is a jump to skip a code block)
-		if (V[(opcode & 0x0F00) >> 8] != V[(opcode & 0x00F0) >> 4])
+		NEXT;
+	OP(CHIP8_OP_LD_REG) // 8XY0: Sets VX to the value of VY.
+		V[x] = V[y];
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_OR) // 8XY1: Sets VX to VX or VY. (Bitwise OR operation)
+		V[x] |= V[y];
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_AND) // 8XY2: Sets VX to VX and VY. (Bitwise AND operation)
+		V[x] &= V[y];
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_XOR) // 8XY3: Sets VX to VX xor VY.
+		V[x] ^= V[y];
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_ADD_REG) // 8XY4: Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there isn't.
+		if (V[y] > (0xFF - V[x]))
+			V[0xF] = 1; //carry
+		else
+			V[0xF] = 0;
+		V[x] += V[y];
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_SUB) // 8XY5: VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
+		if (V[y] > V[x])
+			V[0xF] = 0; // borrow
+		else
+			V[0xF] = 1;
+
+		V[x] -= V[y];
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_SHR) // 8XY6: Shifts VX right by one. VF is set to the value of the least significant bit of VX before the shift. On current implementations Y is ignored.
+		V[0xF] = V[x] & 0x1;
+		V[x] >>= 1;
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_SUBN) // 8XY7: Sets VX to VY minus VX. VF is set to 0 when there's a borrow, and 1 when there isn't.
+		if (V[x] > V[y])
+			V[0xF] = 0;
+		else
+			V[0xF] = 1;
+
+		V[x] = V[y] - V[x];
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_SHL) // 8XYE: Shifts VX left by one. VF is set to the value of the most significant bit of VX before the shift.
+		V[0xF] = (V[x] & 0x80) >> 7; // MSB, 0x80 in binary 0b10000000
+		V[x] <<= 1;
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_SNE_REG) // 9XY0: Skips the next instruction if VX doesn't equal VY. (Usually the next instruction is a jump to skip a code block)
+		if (V[x] != V[y])
 			pc += 4;
 		else
-            pc += 2;
-		break;
-	case 0xA000: // ANNN: Sets I to the address NNN
-		I = (opcode & 0x0FFF);
+			pc += 2;
+		NEXT;
+	OP(CHIP8_OP_LD_I) // ANNN: Sets I to the address NNN
+		I = insn->nnn;
 		pc += 2;
-		break;
-	case 0xB000: // BNNN: Jumps to the address NNN plus V0.
-		pc = (opcode + V[0]) & 0x0FFF;
-		break;
-	case 0xC000: // CXNN: Sets VX to the result of a bitwise and operation on a random number (Typically: 0 to 255) and NN.
-		V[(opcode & 0x0F00) >> 8] = ((rand()%0xFF) & (opcode & 0x00FF));
+		NEXT;
+	OP(CHIP8_OP_JP_V0) // BNNN: Jumps to the address NNN plus V0.
+		pc = (insn->nnn + V[0]) & 0x0FFF;
+		NEXT;
+	OP(CHIP8_OP_RND) // CXNN: Sets VX to the result of a bitwise and operation on a random number (Typically: 0 to 255) and NN.
+		V[x] = chip8_rng_next(rng) & insn->nn;
+		++sideEffects;
 		pc += 2;
-		break;
-	case 0xD000:								 // DXYN: Draws a sprite at coordinate (VX, VY) that has a width of 8 pixels and a height of N pixels. Each row of 8 pixels is read as bit-coded starting from memory location I;
-    {
-        uint8_t vx = (opcode & 0x0F00) >> 8; // Need to bit shift by 8 to get to a single base16 digit.
-        uint8_t vy = (opcode & 0x00F0) >> 4; // Need to bit shift by 4 to get to a single base16 digit.
-
-        uint8_t xpixel = V[vx]; // Get x-pixel position from register Vx
-        uint8_t ypixel = V[vy]; // Get y-pixel position from register Vy
-        uint8_t nrows = (opcode & 0x000F); // Get num of rows to draw.
-        uint32_t gfxarraypos = 0x0; // Variable used to calculate position within gfx memory array based on x and y positions.
-
-        uint8_t newpixeldata = 0x0; // Variable used to hold the new pixel data from memory[I, I+1] etc.
-        uint8_t oldpixelbit = 0x0; // Variable used to hold old pixel bit currently on screen.
-        uint8_t newpixelbit = 0x0; // Variable used to hold new pixel bit, grabbed from the newpixeldata variable.
-
-        logger(CHIP8_LOG_INFO, "DRAW X %d Y %d height %d\n", xpixel,ypixel,nrows);
-        
-        V[0xF] = 0; // Set VF to 0 initially (from specs).
-
-        for (int ypos = 0; ypos < nrows; ypos++) { // Loop through number of rows to display from opcode.
-            newpixeldata = memory[I + ypos]; // Get the first row of pixel data.
-            for (int xpos = 0; xpos < 8; xpos++) { // Loop though the x-positions.
-                gfxarraypos = ((ypixel + ypos) * 64) + (xpixel + xpos); // Calculate the gfx memory array position
-                newpixelbit = (newpixeldata & (0x80 >> xpos)); // Get the pixel bit value from within the 8-bit data. (will be > 0 if there is a pixel)
-                if (newpixelbit != 0) { // Set new pixel only if there is data.
-                    oldpixelbit = gfx[gfxarraypos]; // Get the previous pixel value (already in the form of 1 or 0).
-                    if (oldpixelbit == 1) V[0xF] = 1; // Set VF to 1 if pixel will be unset (from specs, used for collision detection).
-                    gfx[gfxarraypos] = gfx[gfxarraypos] ^ 0x01; // Toggle pixel using XOR.
-                }
-            }
-        }
-        
+		NEXT;
+	OP(CHIP8_OP_DRW)							 // DXYN: Draws a sprite at coordinate (VX, VY) that has a width of 8 pixels and a height of N pixels. Each row of 8 pixels is read as bit-coded starting from memory location I;
+	{
+		uint8_t xpixel = V[x] & (SCREEN_X - 1); // Get x-pixel position from register Vx, wrapped to the screen
+		uint8_t ypixel = V[y] & (SCREEN_Y - 1); // Get y-pixel position from register Vy, wrapped to the screen
+		uint8_t nrows = insn->n; // Get num of rows to draw.
+		++sideEffects;
+
+		CHIP8_LOG(CHIP8_LOG_DEBUG, "DRAW X %d Y %d height %d\n", V[x],V[y],nrows);
+
+		V[0xF] = 0; // Set VF to 0 initially (from specs).
+		CHIP8_PROFILE_COUNT(profile->drawRows += nrows);
+
+		for (int ypos = 0; ypos < nrows; ypos++) { // Loop through number of rows to display from opcode.
+			uint64_t sprite = (uint64_t)memory[(I + ypos) & 0xFFF] << 56; // Sprite row placed at x = 0.
+			if (xpixel != 0)
+				sprite = (sprite >> xpixel) | (sprite << (64 - xpixel)); // Rotate into place, wrapping at the right edge.
+
+			unsigned rowpos = (ypixel + ypos) & (SCREEN_Y - 1);
+			uint64_t &row = gfx[rowpos];
+			if (row & sprite) V[0xF] = 1; // Set VF to 1 if any pixel will be unset (from specs, used for collision detection).
+			row ^= sprite; // Toggle pixels using XOR.
+			if (sprite)
+				dirtyRows |= 1u << rowpos;
+		}
+
 		drawFlag = true;
 		pc += 2;
-		break;
+		NEXT;
 	}
-	case 0xE000:
-		switch (opcode & 0x00FF)
+	OP(CHIP8_OP_SKP) // EX9E: Skips the next instruction if the key stored in VX is pressed. (Usually the next instruction is a jump to skip a code block)
+		if (keypad[V[x]] != 0)
+			pc += 4;
+		else
+			pc += 2;
+		NEXT;
+	OP(CHIP8_OP_SKNP) // EXA1: Skips the next instruction if the key stored in VX isn't pressed. (Usually the next instruction is a jump to skip a code block)
+		if (keypad[V[x]] == 0)
+			pc += 4;
+		else
+			pc += 2;
+		NEXT;
+	OP(CHIP8_OP_LD_VX_DT) // FX07: Sets VX to the value of the delay timer.
+		V[x] = delay_timer;
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_LD_VX_K) // FX0A: A key press is awaited, and then stored in VX. (Blocking Operation. All instruction halted until next key event)
+	{
+		bool press = false;
+
+		for (size_t i = 0; i < 16; ++i)
 		{
-		case 0x00A1: // EXA1: Skips the next instruction if the key stored in VX isn't pressed. (Usually the next instruction is a jump to skip a code block)
-			if (keypad[V[(opcode & 0x0F00) >> 8]] == 0)
-				pc += 4;
-			else
-                pc += 2;
-			break;
-		case 0x009E: // EX9E: Skips the next instruction if the key stored in VX is pressed. (Usually the next instruction is a jump to skip a code block)
-			if (keypad[V[(opcode & 0x0F00) >> 8]] != 0)
-				pc += 4;
-			else
-                pc += 2;
-			break;
-		default:
-			logger(CHIP8_LOG_INFO, "Unknown opcode [0x8000]: 0x%X\n", opcode);
-			run = false;
+			if (keypad[i] != 0)
+			{
+				V[x] = i;
+				press = true;
+			}
 		}
-		break;
-	case 0xF000:
-		switch (opcode & 0x00FF)
+		if (!press)
 		{
-		case 0x0007: // FX07: Sets VX to the value of the delay timer.
-			V[(opcode & 0x0F00) >> 8] = delay_timer;
-			pc += 2;
-			break;
-		case 0x000A: // FX0A: A key press is awaited, and then stored in VX. (Blocking Operation. All instruction halted until next key event)
-        {
-            bool press = false;
-            
-            for (size_t i = 0; i < 16; ++i)
-            {
-                if (keypad[i] != 0)
-                {
-                    V[(opcode & 0x0F00) >> 8] = i;
-                    press = true;
-                }
-            }
-			if (!press)
-                return;
-            pc += 2;
-			break;
-        }
-		case 0x0015: // FX15: Sets the delay timer to VX.
-			delay_timer = V[(opcode & 0x0F00) >> 8];
-			pc += 2;
-			break;
-		case 0x0018: // FX18: Sets the sound timer to VX.
-			sound_timer = V[(opcode & 0x0F00) >> 8];
-			pc += 2;
-			break;
-		case 0x001E: // FX1E: Adds VX to I. VF is set to 1 when range overflow
-			if (I + V[(opcode & 0x0F00) >> 8] > 0xFFF)
-				V[0xF] = 1;
-			else
-				V[0xF] = 0;
-			I += V[(opcode & 0x0F00) >> 8];
-			pc += 2;
-			break;
-		case 0x0029: // FX29: Sets I to the location of the sprite for the character in VX. Characters 0-F (in hexadecimal) are represented by a 4x5 font.
-            logger(CHIP8_LOG_INFO, "SPRITE VX %X, index %d\n", V[(opcode & 0x0F00) >> 8], V[(opcode & 0x0F00) >> 8] * 0x5);
-			I = V[(opcode & 0x0F00) >> 8] * 0x05;
-			pc += 2;
-			break;
-		case 0x0033:												// FX33: Stores the binary-coded decimal representation of VX, with the most significant of three digits at the address in I, the middle digit at I plus 1, 
-			memory[I] = V[(opcode & 0x0F00) >> 8] / 100;			//       and the least significant digit at I plus 2. (In other words, take the decimal representation of VX, place the hundreds digit in memory at location in I,
-			memory[I + 1] = (V[(opcode & 0x0F00) >> 8] % 100) / 10;	//	      the tens digit at location I+1, and the ones digit at location I+2.)
-			memory[I + 2] = (V[(opcode & 0x0F00) >> 8] % 100) % 10;
-            logger(CHIP8_LOG_INFO, "BCD V[%X] = %d, hundred %d ten %d one %d\n",(opcode & 0x0F00) >> 8,V[(opcode & 0x0F00) >> 8],memory[I],memory[I+1],memory[I+2]);
-			pc += 2;
-			break;
-		case 0x0055: // FX55: Store registers V0 through Vx in memory starting at location I
-			for (size_t i = 0; i <= ((opcode & 0x0F00) >> 8); ++i)
-				memory[I + i] = V[i];
-			I += ((opcode & 0x0F00) >> 8) + 1;
-			pc += 2;
-			break;
-		case 0x0065: // FX65: Read registers V0 through Vx from memory starting at location I.
-			for (size_t i = 0; i <= ((opcode & 0x0F00) >> 8); ++i)
-				V[i] = memory[I + i];
-			I += ((opcode & 0x0F00) >> 8) + 1;
-			pc += 2;
-			break;
-		default:
-			logger(CHIP8_LOG_INFO, "Unknown opcode [0xF000]: 0x%X\n", opcode);
-			run = false;
+			// The keypad cannot change inside a burst, so the rest of it would be
+			// spent re-running this instruction. Account for that in one go.
+			if (INSN_TIMERS)
+				frm += count;
+			CHIP8_PROFILE_COUNT(profile->idleSkipped += count);
+			count = 0;
+			goto done;
 		}
-		break;
-	default:
-		logger(CHIP8_LOG_INFO, "Unknown opcode: 0x%X\n", opcode);
-		run = false;
+		pc += 2;
+		NEXT;
 	}
-	
-	if (frm >= 9)
-    {
-        runTimers();
-        frm = 0;
-    }
-
-	if (pee == pc)
+	OP(CHIP8_OP_LD_DT_VX) // FX15: Sets the delay timer to VX.
+		delay_timer = V[x];
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_LD_ST_VX) // FX18: Sets the sound timer to VX.
+		sound_timer = V[x];
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_ADD_I) // FX1E: Adds VX to I. VF is set to 1 when range overflow
+		if (I + V[x] > 0xFFF)
+			V[0xF] = 1;
+		else
+			V[0xF] = 0;
+		I += V[x];
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_LD_F) // FX29: Sets I to the location of the sprite for the character in VX. Characters 0-F (in hexadecimal) are represented by a 4x5 font.
+		CHIP8_LOG(CHIP8_LOG_DEBUG, "SPRITE VX %X, index %d\n", V[x], V[x] * 0x5);
+		I = V[x] * 0x05;
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_LD_B)									// FX33: Stores the binary-coded decimal representation of VX, with the most significant of three digits at the address in I, the middle digit at I plus 1,
+		memory[I & 0xFFF] = V[x] / 100;					//       and the least significant digit at I plus 2. (In other words, take the decimal representation of VX, place the hundreds digit in memory at location in I,
+		memory[(I + 1) & 0xFFF] = (V[x] % 100) / 10;	//	      the tens digit at location I+1, and the ones digit at location I+2.)
+		memory[(I + 2) & 0xFFF] = (V[x] % 100) % 10;
+		invalidateDecode(I & 0xFFF, 3);
+		CHIP8_LOG(CHIP8_LOG_DEBUG, "BCD V[%X] = %d, hundred %d ten %d one %d\n",x,V[x],memory[I & 0xFFF],memory[(I + 1) & 0xFFF],memory[(I + 2) & 0xFFF]);
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_LD_MEM_VX) // FX55: Store registers V0 through Vx in memory starting at location I
+		for (size_t i = 0; i <= x; ++i)
+			memory[(I + i) & 0xFFF] = V[i];
+		invalidateDecode(I & 0xFFF, x + 1);
+		I += x + 1;
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_LD_VX_MEM) // FX65: Read registers V0 through Vx from memory starting at location I.
+		for (size_t i = 0; i <= x; ++i)
+			V[i] = memory[(I + i) & 0xFFF];
+		I += x + 1;
+		pc += 2;
+		NEXT;
+	OP(CHIP8_OP_UNKNOWN)
+#ifndef CHIP8_THREADED
+	default:
+#endif
 	{
-		logger(CHIP8_LOG_INFO, "Infinite loop detected at 0x%X, opcode 0x%X\n", pc, opcode);
+		uint16_t opcode = fetchOpcode(pc);
+		if (opcode == 0 && fetchOpcode(pc + 2) == 0)
+			CHIP8_LOG(CHIP8_LOG_ERROR, "Invalid pc 0x%X\n", pc); //shouldn't happen
+		CHIP8_LOG(CHIP8_LOG_WARN, "Unknown opcode [0x%X]: 0x%X\n", opcode & 0xF000, opcode);
 		run = false;
+		NEXT;
+	}
+#ifndef CHIP8_THREADED
+		}
+		RETIRE();
+#endif
 	}
+
+done:
+	this->pc = pc;
+	this->I = I;
+	this->sp = sp;
+	retiredCount += executed;
 }
 
+template void chip8::execute<true>(unsigned count);
+template void chip8::execute<false>(unsigned count);
+
+#undef OP
+#undef NEXT
+#undef FETCH
+#undef RETIRE
+#ifdef CHIP8_THREADED
+#pragma GCC diagnostic pop
+#endif
+
 void * const chip8::getMemory()
 {
 	return memory;
 }
+
+void chip8::getPixels(uint8_t *pixels) const
+{
+	for (unsigned y = 0; y < SCREEN_Y; ++y)
+		for (unsigned x = 0; x < SCREEN_X; ++x)
+			*pixels++ = getPixel(x, y);
+}
+
+bool chip8::serialize(void *data, size_t size) const
+{
+	if (data == NULL || size < sizeof(chip8_savestate))
+		return false;
+
+	chip8_savestate *state = static_cast<chip8_savestate*>(data);
+	state->magic = CHIP8_STATE_MAGIC;
+	state->version = CHIP8_STATE_VERSION;
+	state->pc = pc;
+	state->I = I;
+	state->sp = sp;
+	memcpy(state->stack, stack, sizeof(stack));
+	memcpy(state->V, V, sizeof(V));
+	state->delay_timer = delay_timer;
+	state->sound_timer = sound_timer;
+	state->frm = frm;
+	state->run = run;
+	memcpy(state->keypad, keypad, sizeof(keypad));
+	memcpy(state->gfx, gfx, sizeof(gfx));
+	memcpy(state->memory, memory, sizeof(memory));
+	state->rng = rng;
+	return true;
+}
+
+bool chip8::unserialize(const void *data, size_t size)
+{
+	if (data == NULL || size < offsetof(chip8_savestate, rng))
+		return false;
+
+	const chip8_savestate *state = static_cast<const chip8_savestate*>(data);
+	if (state->magic != CHIP8_STATE_MAGIC || !validStack(state->sp, state->run != 0))
+		return false;
+	if (state->version == CHIP8_STATE_VERSION && size >= sizeof(chip8_savestate))
+		rng = state->rng != 0 ? state->rng : chip8_rng_seed(seed);
+	else if (state->version != 1)	// no rng yet, keep the current sequence
+		return false;
+
+	pc = state->pc;
+	I = state->I;
+	sp = state->sp;
+	memcpy(stack, state->stack, sizeof(stack));
+	memcpy(V, state->V, sizeof(V));
+	delay_timer = state->delay_timer;
+	sound_timer = state->sound_timer;
+	frm = state->frm;
+	run = state->run != 0;
+	memcpy(keypad, state->keypad, sizeof(keypad));
+	memcpy(gfx, state->gfx, sizeof(gfx));
+	dirtyRows = 0xFFFFFFFF;
+	loadMemory(state->memory);
+	return true;
+}
+
+// Only copy (and drop decoded instructions for) the parts of memory that differ,
+// consecutive states usually share nearly all of it.
+void chip8::loadMemory(const uint8_t *src)
+{
+	for (size_t block = 0; block < sizeof(memory); block += 64)
+	{
+		if (memcmp(memory + block, src + block, 64) != 0)
+		{
+			memcpy(memory + block, src + block, 64);
+			invalidateDecode(block, 64);
+		}
+	}
+}
+
+void chip8::fork(chip8_fork &state) const
+{
+	memcpy(state.gfx, gfx, sizeof(gfx));
+	state.rng = rng;
+	memcpy(state.stack, stack, sizeof(stack));
+	state.pc = pc;
+	state.I = I;
+	state.sp = sp;
+	memcpy(state.V, V, sizeof(V));
+	memcpy(state.keypad, keypad, sizeof(keypad));
+	state.delay_timer = delay_timer;
+	state.sound_timer = sound_timer;
+	state.frm = frm;
+	state.run = run ? 1 : 0;
+}
+
+bool chip8::resume(const chip8_fork &state)
+{
+	if (!validStack(state.sp, state.run != 0))
+		return false;
+	memcpy(gfx, state.gfx, sizeof(gfx));
+	rng = state.rng;
+	memcpy(stack, state.stack, sizeof(stack));
+	pc = state.pc;
+	I = state.I;
+	sp = state.sp;
+	memcpy(V, state.V, sizeof(V));
+	memcpy(keypad, state.keypad, sizeof(keypad));
+	delay_timer = state.delay_timer;
+	sound_timer = state.sound_timer;
+	frm = state.frm;
+	run = state.run != 0;
+	dirtyRows = 0xFFFFFFFF;
+	return true;
+}
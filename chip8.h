@@ -1,16 +1,20 @@
+#ifndef CHIP8_H
+#define CHIP8_H
+
 #include <cstdarg>
 #include <memory>
 #include <stdint.h>
 #include <time.h>
-//linux INT_MAX & memset & rand/srand
+//linux INT_MAX & memset & offsetof
 #include <climits>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 
 static const unsigned int SCREEN_X = 64;
 static const unsigned int SCREEN_Y = 32;
 
-static uint8_t chip8_fontset[80] =
+static const uint8_t chip8_fontset[80] =
 {
 	0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
 	0x20, 0x60, 0x20, 0x20, 0x70, // 1
@@ -40,15 +44,163 @@ enum CHIP8_LOG_LEVEL
 	CHIP8_LOG_DUMMY = INT_MAX
 };
 
+// Calls below this level are compiled out, arguments and all.
+#ifndef CHIP8_LOG_MIN_LEVEL
+#define CHIP8_LOG_MIN_LEVEL CHIP8_LOG_INFO
+#endif
+
+#define CHIP8_LOG_BIT(level)	(1u << (level))
+static const uint32_t CHIP8_LOG_DEFAULT_MASK = CHIP8_LOG_BIT(CHIP8_LOG_INFO) | CHIP8_LOG_BIT(CHIP8_LOG_WARN) | CHIP8_LOG_BIT(CHIP8_LOG_ERROR);
+
+typedef void (*chip8_log_cb)(int level, const char *fmt, ...);
+
+class chip8logring;
+struct chip8_profile;
+
+// Handler indices for pre-decoded instructions, one per distinct opcode behaviour.
+enum CHIP8_OP
+{
+	CHIP8_OP_UNDECODED = 0,	// record is stale, decode from memory on next fetch
+	CHIP8_OP_CLS,			// 00E0
+	CHIP8_OP_RET,			// 00EE
+	CHIP8_OP_SCHIP,			// 00CN, 00FB-00FF
+	CHIP8_OP_JP,			// 1NNN
+	CHIP8_OP_CALL,			// 2NNN
+	CHIP8_OP_SE_BYTE,		// 3XNN
+	CHIP8_OP_SNE_BYTE,		// 4XNN
+	CHIP8_OP_SE_REG,		// 5XY0
+	CHIP8_OP_LD_BYTE,		// 6XNN
+	CHIP8_OP_ADD_BYTE,		// 7XNN
+	CHIP8_OP_LD_REG,		// 8XY0
+	CHIP8_OP_OR,			// 8XY1
+	CHIP8_OP_AND,			// 8XY2
+	CHIP8_OP_XOR,			// 8XY3
+	CHIP8_OP_ADD_REG,		// 8XY4
+	CHIP8_OP_SUB,			// 8XY5
+	CHIP8_OP_SHR,			// 8XY6
+	CHIP8_OP_SUBN,			// 8XY7
+	CHIP8_OP_SHL,			// 8XYE
+	CHIP8_OP_SNE_REG,		// 9XY0
+	CHIP8_OP_LD_I,			// ANNN
+	CHIP8_OP_JP_V0,			// BNNN
+	CHIP8_OP_RND,			// CXNN
+	CHIP8_OP_DRW,			// DXYN
+	CHIP8_OP_SKP,			// EX9E
+	CHIP8_OP_SKNP,			// EXA1
+	CHIP8_OP_LD_VX_DT,		// FX07
+	CHIP8_OP_LD_VX_K,		// FX0A
+	CHIP8_OP_LD_DT_VX,		// FX15
+	CHIP8_OP_LD_ST_VX,		// FX18
+	CHIP8_OP_ADD_I,			// FX1E
+	CHIP8_OP_LD_F,			// FX29
+	CHIP8_OP_LD_B,			// FX33
+	CHIP8_OP_LD_MEM_VX,		// FX55
+	CHIP8_OP_LD_VX_MEM,		// FX65
+	CHIP8_OP_UNKNOWN,
+
+	CHIP8_OP_COUNT
+};
+
+// Pre-decoded instruction, operand fields already extracted from the opcode.
+struct chip8_insn
+{
+	uint8_t op;		// CHIP8_OP
+	uint8_t x;
+	uint8_t y;
+	uint8_t n;
+	uint8_t nn;
+	uint16_t nnn;
+};
+
+static const uint32_t CHIP8_STATE_MAGIC = 0x38504843;	// "CHP8"
+static const uint32_t CHIP8_STATE_VERSION = 2;	// 2 appended rng, version 1 states still load
+
+// Savestate block. Packed with a fixed layout so it can be written straight
+// into (or read from) any frontend buffer regardless of alignment.
+#pragma pack(push, 1)
+struct chip8_savestate
+{
+	uint32_t magic;
+	uint32_t version;
+
+	uint16_t pc;
+	uint16_t I;
+	uint16_t sp;
+	uint16_t stack[16];
+	uint8_t V[16];
+
+	uint8_t delay_timer;
+	uint8_t sound_timer;
+	uint8_t frm;
+	uint8_t run;
+
+	uint8_t keypad[16];
+	uint64_t gfx[SCREEN_Y];
+	uint8_t memory[0x1000];
+
+	uint32_t rng;
+};
+#pragma pack(pop)
+
+// Everything chip8::fork copies: the machine minus memory, 334 bytes. A whole
+// machine is a single memcpy too (chip8 is trivially copyable), but at ~37 KB,
+// most of it memory and the decode cache, that is too much to keep per search
+// node. So a fork is field by field instead: memory is left to the caller so
+// that forks which never write to it (FX33, FX55) share their parent's copy,
+// the decode cache is rebuilt from memory, and the packing without padding
+// makes equal states compare and hash equal byte for byte.
+#pragma pack(push, 1)
+struct chip8_fork
+{
+	uint64_t gfx[SCREEN_Y];
+	uint32_t rng;
+	uint16_t stack[16];
+	uint16_t pc;
+	uint16_t I;
+	uint16_t sp;
+	uint8_t V[16];
+	uint8_t keypad[16];
+	uint8_t delay_timer;
+	uint8_t sound_timer;
+	uint8_t frm;
+	uint8_t run;
+};
+#pragma pack(pop)
+
+static const uint32_t CHIP8_DEFAULT_SEED = 0x43485038;
+
+// CXNN's generator, xorshift32. The state is never 0, seeds are hashed first
+// so that nearby seeds do not start out with nearby (and small) outputs.
+static inline uint32_t chip8_rng_seed(uint32_t seed)
+{
+	seed ^= seed >> 16;
+	seed *= 0x85EBCA6B;
+	seed ^= seed >> 13;
+	seed *= 0xC2B2AE35;
+	seed ^= seed >> 16;
+	return seed != 0 ? seed : CHIP8_DEFAULT_SEED;
+}
+
+static inline uint8_t chip8_rng_next(uint32_t &state)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state >> 24;
+}
+
+// Everything a machine needs is held inline: no allocations, no globals, and
+// the type is trivially copyable. Instances can be placement-new'd into an
+// arena and cloned with memcpy or plain assignment. A clone shares the
+// logger and log ring pointers, which are not owned.
 class chip8
 {
 public:
 	chip8();
-	~chip8();
 
 	void Reset();
 
-	uint8_t gfx[SCREEN_X * SCREEN_Y];	// 64x32 pixel monochrome display
+	uint64_t gfx[SCREEN_Y];				// 64x32 pixel monochrome display, one word per row, MSB is x = 0
 	uint8_t keypad[16];					// hex keypad
 
 	bool drawFlag;
@@ -56,15 +208,45 @@ public:
 
 	void awaitKeypressComplete();
 	void emulateCycle();
+	void emulateCycles(unsigned count);
+	void runFrame(unsigned ipf);		// ipf instructions with the timers held, then one 60 Hz timer tick
+	uint64_t retired() const { return retiredCount; }	// instructions executed since Reset; idle periods runFrame drops and FX0A waits are not
 	bool loadApplication(const void * data, size_t size);
+	void setSeed(uint32_t seed);		// restarts the RND sequence, Reset restarts it from the same seed
 	void setLogger(void * log_func);
+	void setLogMask(uint32_t mask) { logMask = mask; }	// CHIP8_LOG_BIT of each level to report
+	void setLogRing(chip8logring *ring) { logRing = ring; }	// defer formatting to whoever drains ring, NULL to log directly
+	bool setProfile(chip8_profile *counters);	// count into counters, NULL to stop; false when built without CHIP8_PROFILE
 
 	void * const getMemory();
+	void getPixels(uint8_t *pixels) const;	// byte view of gfx, SCREEN_X * SCREEN_Y entries of 0 or 1
+	uint8_t getPixel(unsigned x, unsigned y) const { return (gfx[y] >> (63 - x)) & 1; }
+	uint32_t getDirtyRows() const { return dirtyRows; }	// bit y set when gfx[y] was touched since the last clear
+	void clearDirtyRows() { dirtyRows = 0; }
 	void runTimers();
 
+	bool takeMemoryWrites(uint16_t &lo, uint16_t &hi);	// range [lo, hi) of memory changed since the last call
+	static void decodeOpcode(uint16_t opcode, chip8_insn &insn);	// what execute dispatches on for opcode
+
+	static size_t serializeSize() { return sizeof(chip8_savestate); }
+	bool serialize(void *data, size_t size) const;
+	bool unserialize(const void *data, size_t size);
+
+	void fork(chip8_fork &state) const;		// everything but memory
+	bool resume(const chip8_fork &state);	// back to a forked state, memory untouched; false on a bad stack
+	void loadMemory(const uint8_t *page);	// 0x1000 bytes, only the parts that differ are copied and re-decoded
+
 private:
+	friend class chip8jit;
+
+	template <bool INSN_TIMERS> void execute(unsigned count);
+	uint16_t fetchOpcode(uint16_t addr) const;
+	void decode(uint16_t addr, chip8_insn &insn) const;
+	void invalidateDecode(uint16_t addr, uint16_t len);
+	unsigned skipIdle(uint16_t jump, uint16_t I, uint16_t sp, unsigned count);	// count left after dropping idle periods
+	static bool validStack(unsigned sp, bool run) { return sp < 16 || (sp == 16 && !run); }	// 16 only after an overrun, which stops the machine
+
 	uint16_t pc;			// program counter
-	uint16_t opcode;
 	uint16_t I;				// index register
 	uint16_t sp;			// stack pointer
 
@@ -72,11 +254,44 @@ private:
 	uint16_t stack[16];		// call stack
 	uint8_t memory[0x1000];	// 4k memory
 
+	chip8_insn decoded[0x1000];	// decode cache, one record per start address (ROMs do execute at odd addresses)
+
+	// Machine state at the last backward jump of the current runFrame burst.
+	struct idle_probe
+	{
+		uint16_t jump;
+		uint16_t I;
+		uint16_t sp;
+		uint16_t stack[16];
+		uint8_t V[16];
+		uint8_t delay_timer;
+		uint8_t sound_timer;
+		uint32_t sideEffects;
+		unsigned count;		// budget left after the jump, 0 when unset
+		unsigned next;		// probe again at the first backward jump with this much budget left
+	};
+	enum { IDLE_PROBE_INTERVAL = 64 };
+	idle_probe idleProbe;
+	uint32_t sideEffects;	// bumped by everything idle_probe does not compare: memory and display writes, RND
+
+	uint32_t dirtyRows;		// one bit per display row
+	uint16_t memWriteLo;	// memory changed in [memWriteLo, memWriteHi), empty when equal
+	uint16_t memWriteHi;
+
 	uint8_t delay_timer;
 	uint8_t sound_timer;
     
     uint8_t frm;            // for timer updates
 
-	typedef void (*log_cb)(int level, const char *fmt, ...);
+	uint32_t seed;
+	uint32_t rng;			// xorshift32 state, see chip8_rng_next
+	uint64_t retiredCount;
+
+	typedef chip8_log_cb log_cb;
 	log_cb logger;
+	uint32_t logMask;
+	chip8logring *logRing;
+	chip8_profile *profile;
 };
+
+#endif
@@ -0,0 +1,802 @@
+// Benchmarks for the core's hot paths: opcode dispatch, DXYN, 00E0, display
+// conversion, ROM loading and savestates, plus every ROM given (or found in
+// rom/) run for a fixed number of frames. Flags and JSON output follow Google
+// Benchmark so its tooling can read the results.
+//
+// The ROM benchmarks double as a regression gate: --baseline_out stores their
+// median ns/frame and instructions/sec, --baseline reruns them and fails when
+// a ROM got slower than the stored median by more than --threshold percent.
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <dirent.h>
+#include <functional>
+#include <map>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "chip8.h"
+#include "chip8video.h"
+
+struct benchmark
+{
+	std::string name;
+	std::function<void(uint64_t)> run;	// runs the benchmark that many iterations
+	uint64_t items;						// items per iteration, 0 to leave items_per_second out
+};
+
+struct result
+{
+	std::string name;
+	uint64_t iterations;
+	double real_ns;		// per iteration
+	double cpu_ns;
+	double items_per_second;
+	unsigned repetitions;	// runs the times are the median of
+};
+
+static volatile uint64_t sink;	// results the benchmarks compute go here so nothing is dropped
+
+static std::vector<uint8_t> repeat_opcode(uint16_t opcode, const uint16_t *prologue, unsigned nprologue)
+{
+	// Straight-line copies of opcode, then a jump back to the first of them.
+	std::vector<uint8_t> program;
+	for (unsigned i = 0; i < nprologue; ++i)
+	{
+		program.push_back(prologue[i] >> 8);
+		program.push_back(prologue[i] & 0xFF);
+	}
+	uint16_t loop = 0x200 + (uint16_t)program.size();
+	while (program.size() < 0xD00 - 2)
+	{
+		program.push_back(opcode >> 8);
+		program.push_back(opcode & 0xFF);
+	}
+	program.push_back(0x10 | (loop >> 8));
+	program.push_back(loop & 0xFF);
+	return program;
+}
+
+// One iteration is one instruction. emulateCycles is used rather than
+// runFrame so idle loop detection never folds the loop away.
+static void add_program(std::vector<benchmark> &out, const std::string &name, const std::vector<uint8_t> &program)
+{
+	benchmark b;
+	b.name = name;
+	b.items = 1;
+	b.run = [program](uint64_t iterations)
+	{
+		static chip8 emu;
+		emu.Reset();
+		emu.loadApplication(&program[0], program.size());
+		while (iterations > 0)
+		{
+			unsigned n = iterations > 0x40000000 ? 0x40000000 : (unsigned)iterations;
+			emu.emulateCycles(n);
+			iterations -= n;
+		}
+		sink += emu.gfx[0] + emu.getDirtyRows();
+	};
+	out.push_back(b);
+}
+
+static void add_dispatch(std::vector<benchmark> &out)
+{
+	struct op { const char *name; uint16_t opcode; };
+	static const op ops[] =
+	{
+		{ "LD_BYTE", 0x6A12 },		// 6XNN
+		{ "ADD_BYTE", 0x7A01 },		// 7XNN
+		{ "LD_REG", 0x8AB0 },		// 8XY0
+		{ "XOR", 0x8AB3 },			// 8XY3
+		{ "ADD_REG", 0x8AB4 },		// 8XY4
+		{ "SHR", 0x8AB6 },			// 8XY6
+		{ "SE_BYTE", 0x3AFF },		// 3XNN, not taken
+		{ "SNE_REG", 0x9AB0 },		// 9XY0, not taken
+		{ "LD_I", 0xA300 },			// ANNN
+		{ "ADD_I", 0xFA1E },		// FX1E
+		{ "RND", 0xCA0F },			// CXNN
+		{ "SKP", 0xEA9E },			// EX9E, no key held
+		{ "LD_VX_DT", 0xFA07 },		// FX07
+		{ "LD_DT_VX", 0xFA15 },		// FX15
+		{ "LD_F", 0xFA29 },			// FX29
+		{ "LD_B", 0xFA33 },			// FX33, writes over the font
+		{ "LD_VX_MEM", 0xFF65 },	// FX65
+	};
+	for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i)
+		add_program(out, std::string("dispatch/") + ops[i].name, repeat_opcode(ops[i].opcode, NULL, 0));
+
+	// 1NNN chained through memory, each jump to the next word
+	std::vector<uint8_t> jumps;
+	for (uint16_t addr = 0x202; addr < 0xF00; addr += 2)
+	{
+		jumps.push_back(0x10 | (addr >> 8));
+		jumps.push_back(addr & 0xFF);
+	}
+	jumps.push_back(0x12);
+	jumps.push_back(0x00);
+	add_program(out, "dispatch/JP", jumps);
+
+	// 2NNN to a 00EE, two instructions per round trip
+	std::vector<uint8_t> calls = repeat_opcode(0x2F00, NULL, 0);
+	calls.resize(0xF00 - 0x200, 0);
+	calls.push_back(0x00);
+	calls.push_back(0xEE);
+	add_program(out, "dispatch/CALL_RET", calls);
+}
+
+// DXYN with V0/V1 = x/y and I at the program itself, so rows are not blank.
+static void add_draws(std::vector<benchmark> &out)
+{
+	struct pos { const char *name; uint8_t x, y; };
+	static const pos positions[] =
+	{
+		{ "aligned", 8, 4 },
+		{ "unaligned", 3, 4 },
+		{ "wrap", 60, 28 },
+	};
+	static const unsigned heights[] = { 1, 8, 15 };
+	for (size_t p = 0; p < sizeof(positions) / sizeof(positions[0]); ++p)
+		for (size_t h = 0; h < sizeof(heights) / sizeof(heights[0]); ++h)
+		{
+			uint16_t prologue[] = { (uint16_t)(0x6000 | positions[p].x), (uint16_t)(0x6100 | positions[p].y), 0xA200 };
+			char name[64];
+			snprintf(name, sizeof(name), "draw/h%u/%s", heights[h], positions[p].name);
+			add_program(out, name, repeat_opcode((uint16_t)(0xD010 | heights[h]), prologue, 3));
+		}
+
+	uint16_t fill[] = { 0xA200, 0xD01F };	// something on screen for the first clear
+	add_program(out, "clear", repeat_opcode(0x00E0, fill, 2));
+}
+
+static void add_conversion(std::vector<benchmark> &out)
+{
+	static uint64_t cur[SCREEN_Y];
+	static uint64_t prev[SCREEN_Y];
+	static uint16_t fb[SCREEN_X * SCREEN_Y];
+	static uint32_t fb32[SCREEN_X * SCREEN_Y];
+	uint64_t x = 0x9E3779B97F4A7C15ull;
+	for (unsigned y = 0; y < SCREEN_Y; ++y)
+	{
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+		cur[y] = x;
+		prev[y] = x ^ (x >> 3);
+	}
+
+	struct conv { const char *name; uint32_t rows; bool blend; bool wide; };
+	static const conv convs[] =
+	{
+		{ "convert/rgb565/full", 0xFFFFFFFF, false, false },
+		{ "convert/rgb565/4rows", 0x00F00000, false, false },
+		{ "convert/rgb565/blend", 0xFFFFFFFF, true, false },
+		{ "convert/xrgb8888/full", 0xFFFFFFFF, false, true },
+		{ "convert/xrgb8888/blend", 0xFFFFFFFF, true, true },
+	};
+	for (size_t i = 0; i < sizeof(convs) / sizeof(convs[0]); ++i)
+	{
+		conv c = convs[i];
+		benchmark b;
+		b.name = c.name;
+		b.items = 0;
+		b.run = [c](uint64_t iterations)
+		{
+			const uint64_t *p = c.blend ? prev : cur;
+			for (uint64_t i = 0; i < iterations; ++i)
+			{
+				if (c.wide)
+					chip8video_update_xrgb8888(cur, p, c.rows, fb32);
+				else
+					chip8video_update_rgb565(cur, p, c.rows, fb);
+			}
+			sink += fb[SCREEN_X * 20] + fb32[SCREEN_X * 20];
+		};
+		out.push_back(b);
+	}
+}
+
+static void add_state(std::vector<benchmark> &out)
+{
+	benchmark b;
+	b.name = "load_application";
+	b.items = 0;
+	b.run = [](uint64_t iterations)
+	{
+		static chip8 emu;
+		std::vector<uint8_t> rom(0x1000 - 0x200);
+		for (size_t i = 0; i < rom.size(); ++i)
+			rom[i] = (uint8_t)(i * 7 + 1);
+		for (uint64_t i = 0; i < iterations; ++i)
+		{
+			rom[0] = (uint8_t)i;	// a different image each time, as a frontend loading ROMs would see
+			emu.loadApplication(&rom[0], rom.size());
+		}
+		sink += *(uint8_t*)emu.getMemory();
+	};
+	out.push_back(b);
+
+	// serialize + unserialize, of the same state and of two states whose
+	// memory differs in every 64 byte block
+	for (int differ = 0; differ < 2; ++differ)
+	{
+		benchmark s;
+		s.name = differ ? "savestate/roundtrip_dirty" : "savestate/roundtrip";
+		s.items = 0;
+		s.run = [differ](uint64_t iterations)
+		{
+			static chip8 emu;
+			static chip8_savestate states[2];
+			emu.Reset();
+			std::vector<uint8_t> program = repeat_opcode(0x7A01, NULL, 0);
+			emu.loadApplication(&program[0], program.size());
+			emu.serialize(&states[0], sizeof(states[0]));
+			states[1] = states[0];
+			for (size_t i = 0; i < sizeof(states[1].memory); i += 64)
+				states[1].memory[i] ^= 0xFF;
+			for (uint64_t i = 0; i < iterations; ++i)
+			{
+				chip8_savestate &state = states[differ ? i & 1 : 0];
+				emu.serialize(&state, sizeof(state));
+				emu.unserialize(&states[differ ? (i + 1) & 1 : 0], sizeof(state));
+			}
+			sink += emu.gfx[0];
+		};
+		out.push_back(s);
+	}
+}
+
+static bool read_file(const char *path, std::vector<uint8_t> &out)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+		return false;
+	out.clear();
+	uint8_t buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		out.insert(out.end(), buf, buf + n);
+	bool ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
+
+// Keys held during frame in the ROM benchmarks: one key at a time, a different
+// one every 8 frames, down for 4 of them. Enough to get ROMs past their title
+// screens, so the time goes to emulation rather than to idle skipping.
+static uint16_t script_keys(unsigned frame)
+{
+	return frame % 8 < 4 ? 1u << ((frame / 8 * 7 + 5) % 16) : 0;
+}
+
+static void run_rom(chip8 &emu, const std::vector<uint8_t> &rom, unsigned frames, unsigned ipf)
+{
+	emu.setSeed(1);
+	emu.Reset();
+	emu.loadApplication(&rom[0], rom.size());
+	for (unsigned f = 0; f < frames; ++f)
+	{
+		uint16_t keys = script_keys(f);
+		for (unsigned k = 0; k < 16; ++k)
+			emu.keypad[k] = (keys >> k) & 1;
+		emu.runFrame(ipf);
+	}
+}
+
+// One iteration is a fresh machine run for frames frames on script_keys. Items
+// are the instructions it retires, counted once up front since every iteration
+// runs the same; idle periods runFrame skips are not among them.
+static bool add_rom(std::vector<benchmark> &out, const std::string &path, unsigned frames, unsigned ipf)
+{
+	std::vector<uint8_t> rom;
+	if (!read_file(path.c_str(), rom) || rom.empty() || rom.size() > 0x1000 - 0x200)
+	{
+		fprintf(stderr, "%s: cannot load ROM\n", path.c_str());
+		return false;
+	}
+	std::string base = path.substr(path.find_last_of("/\\") + 1);
+	benchmark b;
+	b.name = "rom/" + base.substr(0, base.find_last_of('.'));
+	static chip8 counted;
+	run_rom(counted, rom, frames, ipf);
+	b.items = counted.retired();
+	b.run = [rom, frames, ipf](uint64_t iterations)
+	{
+		static chip8 emu;
+		for (uint64_t i = 0; i < iterations; ++i)
+			run_rom(emu, rom, frames, ipf);
+		sink += emu.gfx[0];
+	};
+	out.push_back(b);
+	return true;
+}
+
+static void find_roms(const char *dir, std::vector<std::string> &paths)
+{
+	DIR *d = opendir(dir);
+	if (d == NULL)
+		return;
+	while (struct dirent *e = readdir(d))
+	{
+		size_t len = strlen(e->d_name);
+		if (len > 4 && strcmp(e->d_name + len - 4, ".ch8") == 0)
+			paths.push_back(std::string(dir) + "/" + e->d_name);
+	}
+	closedir(d);
+	std::sort(paths.begin(), paths.end());
+}
+
+// Grows the iteration count until one run takes at least min_time, the way
+// Google Benchmark does.
+static result measure(const benchmark &b, double min_time)
+{
+	uint64_t iterations = 1;
+	for (;;)
+	{
+		std::clock_t cpu_begin = std::clock();
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		b.run(iterations);
+		double real = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		double cpu = (double)(std::clock() - cpu_begin) / CLOCKS_PER_SEC;
+
+		if (real >= min_time || iterations >= 1000000000ull)
+		{
+			result r;
+			r.name = b.name;
+			r.iterations = iterations;
+			r.real_ns = real * 1e9 / iterations;
+			r.cpu_ns = cpu * 1e9 / iterations;
+			r.items_per_second = b.items > 0 && real > 0 ? (double)b.items * iterations / real : 0;
+			r.repetitions = 1;
+			return r;
+		}
+		double scale = real > min_time / 10 ? min_time * 1.4 / real : 10;
+		uint64_t next = (uint64_t)(iterations * scale);
+		iterations = next > iterations ? next : iterations + 1;
+	}
+}
+
+// Median of repetitions runs after a discarded warmup run, by real time.
+static result measure_median(const benchmark &b, double min_time, unsigned repetitions, double warmup)
+{
+	if (warmup > 0)
+		measure(b, warmup);
+	std::vector<result> runs;
+	for (unsigned i = 0; i < repetitions; ++i)
+		runs.push_back(measure(b, min_time));
+	std::sort(runs.begin(), runs.end(), [](const result &x, const result &y) { return x.real_ns < y.real_ns; });
+	result r = runs[runs.size() / 2];
+	r.repetitions = repetitions;
+	return r;
+}
+
+// Keeps every run on one core, so migrations do not show up as noise.
+static bool pin_cpu(int cpu)
+{
+#ifdef __linux__
+	if (cpu < 0)
+		cpu = sched_getcpu();
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return cpu >= 0 && sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+	(void)cpu;
+	return false;
+#endif
+}
+
+static const char *build_flags()
+{
+	return ""
+#ifdef CHIP8_THREADED
+		" threaded"
+#endif
+#ifdef CHIP8_PROFILE
+		" profile"
+#endif
+#ifdef __OPTIMIZE__
+		" optimized"
+#endif
+		;
+}
+
+static const char *build_type()
+{
+#ifdef __OPTIMIZE__
+	return "release";
+#else
+	return "debug";
+#endif
+}
+
+static void write_json(FILE *out, const char *argv0, const std::vector<result> &results)
+{
+	char date[32];
+	time_t now = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+	fprintf(out, "{\n  \"context\": {\n    \"date\": \"%s\",\n    \"executable\": \"%s\",\n    \"num_cpus\": %u,\n"
+		"    \"library_build_type\": \"%s\",\n    \"chip8_build\": \"%s\",\n    \"video_backend\": \"%s\"\n  },\n  \"benchmarks\": [",
+		date, argv0, std::thread::hardware_concurrency(), build_type(), build_flags()[0] ? build_flags() + 1 : "", chip8video_backend());
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const result &r = results[i];
+		if (r.repetitions > 1)
+			fprintf(out, "%s\n    {\n      \"name\": \"%s_median\",\n      \"run_name\": \"%s\",\n      \"run_type\": \"aggregate\",\n"
+				"      \"repetitions\": %u,\n      \"aggregate_name\": \"median\",\n",
+				i == 0 ? "" : ",", r.name.c_str(), r.name.c_str(), r.repetitions);
+		else
+			fprintf(out, "%s\n    {\n      \"name\": \"%s\",\n      \"run_name\": \"%s\",\n      \"run_type\": \"iteration\",\n",
+				i == 0 ? "" : ",", r.name.c_str(), r.name.c_str());
+		fprintf(out, "      \"iterations\": %llu,\n      \"real_time\": %.3f,\n      \"cpu_time\": %.3f,\n      \"time_unit\": \"ns\"",
+			(unsigned long long)r.iterations, r.real_ns, r.cpu_ns);
+		if (r.items_per_second > 0)
+			fprintf(out, ",\n      \"items_per_second\": %.1f", r.items_per_second);
+		fputs("\n    }", out);
+	}
+	fputs("\n  ]\n}\n", out);
+}
+
+static bool is_rom(const result &r)
+{
+	return r.name.compare(0, 4, "rom/") == 0;
+}
+
+static const char * const BASELINE_INPUT = "script_keys";	// change along with script_keys
+
+static bool write_baseline(const char *path, const std::vector<result> &results, unsigned frames, unsigned ipf)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return false;
+	fprintf(f, "{\n  \"build_type\": \"%s\",\n  \"input\": \"%s\",\n  \"frames\": %u,\n  \"ipf\": %u,\n  \"roms\": {",
+		build_type(), BASELINE_INPUT, frames, ipf);
+	bool first = true;
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const result &r = results[i];
+		if (!is_rom(r))
+			continue;
+		fprintf(f, "%s\n    \"%s\": { \"ns_per_frame\": %.3f, \"insn_per_second\": %.1f }",
+			first ? "" : ",", r.name.c_str() + 4, r.real_ns / frames, r.items_per_second);
+		first = false;
+	}
+	fputs("\n  }\n}\n", f);
+	return fclose(f) == 0;
+}
+
+// Just enough JSON for what write_baseline writes: objects, numbers and
+// strings, stored under their dotted path ("roms.brix.ns_per_frame").
+struct baseline_reader
+{
+	const char *p;
+	std::map<std::string, double> values;
+	std::map<std::string, std::string> strings;
+
+	void space() { while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') ++p; }
+
+	bool string(std::string &out)
+	{
+		if (*p != '"')
+			return false;
+		for (++p; *p != '"'; ++p)
+		{
+			if (*p == '\0')
+				return false;
+			if (*p == '\\' && p[1] != '\0')
+				++p;
+			out += *p;
+		}
+		++p;
+		return true;
+	}
+
+	bool value(const std::string &path)
+	{
+		space();
+		if (*p == '{')
+		{
+			++p;
+			space();
+			if (*p == '}')
+			{
+				++p;
+				return true;
+			}
+			for (;;)
+			{
+				std::string key;
+				space();
+				if (!string(key))
+					return false;
+				space();
+				if (*p++ != ':' || !value(path.empty() ? key : path + "." + key))
+					return false;
+				space();
+				if (*p == '}')
+				{
+					++p;
+					return true;
+				}
+				if (*p++ != ',')
+					return false;
+			}
+		}
+		if (*p == '"')
+			return string(strings[path]);
+		char *end;
+		double v = strtod(p, &end);
+		if (end == p)
+			return false;
+		values[path] = v;
+		p = end;
+		return true;
+	}
+};
+
+// Returns 0 when no ROM slowed down beyond threshold percent, 1 when one did
+// and 2 when the baseline cannot be used. The table goes to out.
+static int compare_baseline(const char *path, const std::vector<result> &results, unsigned frames, unsigned ipf, double threshold,
+	FILE *out)
+{
+	std::vector<uint8_t> text;
+	if (!read_file(path, text))
+	{
+		fprintf(stderr, "%s: cannot read baseline\n", path);
+		return 2;
+	}
+	text.push_back('\0');
+	baseline_reader reader;
+	reader.p = (const char *)&text[0];
+	if (!reader.value(""))
+	{
+		fprintf(stderr, "%s: not a baseline\n", path);
+		return 2;
+	}
+	if (reader.strings["input"] != BASELINE_INPUT)
+	{
+		fprintf(stderr, "%s: recorded with other ROM input, record it again\n", path);
+		return 2;
+	}
+	if (reader.values["frames"] != frames || reader.values["ipf"] != ipf)
+	{
+		fprintf(stderr, "%s: recorded with --frames=%.0f --ipf=%.0f\n", path, reader.values["frames"], reader.values["ipf"]);
+		return 2;
+	}
+	if (reader.strings["build_type"] != build_type())
+	{
+		fprintf(stderr, "%s: recorded with a %s build, this is a %s build\n", path, reader.strings["build_type"].c_str(), build_type());
+		return 2;
+	}
+
+	fprintf(out, "\n%-24s %16s %16s %9s %16s\n", "ROM", "base ns/frame", "ns/frame", "change", "insn/s");
+	unsigned slower = 0;
+	unsigned compared = 0;
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const result &r = results[i];
+		if (!is_rom(r))
+			continue;
+		const char *name = r.name.c_str() + 4;
+		double now = r.real_ns / frames;
+		std::map<std::string, double>::const_iterator base = reader.values.find(std::string("roms.") + name + ".ns_per_frame");
+		if (base == reader.values.end() || base->second <= 0)
+		{
+			fprintf(out, "%-24s %16s %16.1f %9s %16.4g\n", name, "-", now, "new", r.items_per_second);
+			continue;
+		}
+		double change = (now / base->second - 1) * 100;
+		bool fail = change > threshold;
+		slower += fail;
+		++compared;
+		fprintf(out, "%-24s %16.1f %16.1f %+8.1f%% %16.4g%s\n", name, base->second, now, change, r.items_per_second,
+			fail ? "  SLOWER" : "");
+	}
+
+	// Baseline ROMs this run left out would otherwise pass unchecked.
+	unsigned missing = 0;
+	static const std::string prefix = "roms.", suffix = ".ns_per_frame";
+	for (std::map<std::string, double>::const_iterator it = reader.values.begin(); it != reader.values.end(); ++it)
+	{
+		const std::string &key = it->first;
+		if (key.size() <= prefix.size() + suffix.size() || key.compare(0, prefix.size(), prefix) != 0
+			|| key.compare(key.size() - suffix.size(), suffix.size(), suffix) != 0)
+			continue;
+		std::string name = "rom/" + key.substr(prefix.size(), key.size() - prefix.size() - suffix.size());
+		bool ran = false;
+		for (size_t i = 0; i < results.size() && !ran; ++i)
+			ran = results[i].name == name;
+		if (!ran)
+		{
+			fprintf(out, "%-24s %16.1f %16s %9s\n", name.c_str() + 4, it->second, "-", "missing");
+			++missing;
+		}
+	}
+	if (compared == 0 || missing > 0)
+	{
+		fprintf(out, "ERROR: %u ROM(s) compared, %u baseline ROM(s) not run\n", compared, missing);
+		return 2;
+	}
+	if (slower > 0)
+	{
+		fprintf(out, "FAIL: %u ROM(s) more than %.1f%% slower than %s\n", slower, threshold, path);
+		return 1;
+	}
+	fprintf(out, "PASS: no ROM more than %.1f%% slower than %s\n", threshold, path);
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s [options] [rom...]\n"
+		"  --benchmark_filter=TEXT     only benchmarks whose name contains TEXT\n"
+		"  --benchmark_min_time=SECS   minimum time per benchmark (default 0.2)\n"
+		"  --benchmark_format=FMT      console (default) or json\n"
+		"  --benchmark_out=FILE        also write JSON results to FILE\n"
+		"  --frames=N --ipf=N          ROM benchmarks: frames per iteration (default 600)\n"
+		"                              and instructions per frame (default 10)\n"
+		"  --benchmark_list_tests      print the benchmark names and exit\n"
+		"  --benchmark_repetitions=N   report the median of N runs (default 1)\n"
+		"  --benchmark_min_warmup_time=SECS  discarded run before the measured ones\n"
+		"  --pin_cpu=N|current|off     run on one CPU (default: current with --baseline\n"
+		"                              or --baseline_out, off otherwise)\n"
+		"  --baseline_out=FILE         store the ROM results as a baseline\n"
+		"  --baseline=FILE             compare the ROM results with a baseline and\n"
+		"                              exit 1 when one is slower by more than\n"
+		"  --threshold=PCT             percent (default 5)\n"
+		"ROMs default to rom/*.ch8.\n", argv0);
+}
+
+static bool flag(const char *arg, const char *name, const char *&value)
+{
+	size_t len = strlen(name);
+	if (strncmp(arg, name, len) != 0 || arg[len] != '=')
+		return false;
+	value = arg + len + 1;
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	const char *filter = "";
+	double min_time = 0.2;
+	bool json = false;
+	bool list = false;
+	const char *out_path = NULL;
+	unsigned frames = 600;
+	unsigned ipf = 10;
+	unsigned repetitions = 1;
+	double warmup = 0;
+	const char *pin = NULL;
+	const char *baseline_out = NULL;
+	const char *baseline = NULL;
+	double threshold = 5;
+	std::vector<std::string> roms;
+
+	for (int arg = 1; arg < argc; ++arg)
+	{
+		const char *a = argv[arg];
+		const char *value;
+		if (flag(a, "--benchmark_filter", value))
+			filter = value;
+		else if (flag(a, "--benchmark_min_time", value))
+			min_time = atof(value);
+		else if (flag(a, "--benchmark_format", value) && (strcmp(value, "json") == 0 || strcmp(value, "console") == 0))
+			json = strcmp(value, "json") == 0;
+		else if (flag(a, "--benchmark_out", value))
+			out_path = value;
+		else if (flag(a, "--frames", value) && atoi(value) > 0)
+			frames = atoi(value);
+		else if (flag(a, "--ipf", value) && atoi(value) > 0)
+			ipf = atoi(value);
+		else if (flag(a, "--benchmark_repetitions", value) && atoi(value) > 0)
+			repetitions = atoi(value);
+		else if (flag(a, "--benchmark_min_warmup_time", value))
+			warmup = atof(value);
+		else if (flag(a, "--pin_cpu", value))
+			pin = value;
+		else if (flag(a, "--baseline_out", value))
+			baseline_out = value;
+		else if (flag(a, "--baseline", value))
+			baseline = value;
+		else if (flag(a, "--threshold", value) && atof(value) >= 0)
+			threshold = atof(value);
+		else if (strcmp(a, "--benchmark_list_tests") == 0)
+			list = true;
+		else if (a[0] != '-')
+			roms.push_back(a);
+		else
+		{
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (roms.empty())
+		find_roms("rom", roms);
+
+	if ((baseline != NULL || baseline_out != NULL) && strcmp(build_type(), "debug") == 0)
+	{
+		fprintf(stderr, "--baseline and --baseline_out need an optimized build, see BENCH_CFLAGS\n");
+		return 2;
+	}
+	if (pin == NULL && (baseline != NULL || baseline_out != NULL))
+		pin = "current";
+	if (pin != NULL && strcmp(pin, "off") != 0 && !list)
+	{
+		int cpu = strcmp(pin, "current") == 0 ? -1 : atoi(pin);
+		if (!pin_cpu(cpu))
+			fprintf(stderr, "cannot pin to CPU %s, running unpinned\n", pin);
+	}
+
+	std::vector<benchmark> benchmarks;
+	add_dispatch(benchmarks);
+	add_draws(benchmarks);
+	add_conversion(benchmarks);
+	add_state(benchmarks);
+	int status = 0;
+	for (size_t r = 0; r < roms.size(); ++r)
+		if (!add_rom(benchmarks, roms[r], frames, ipf))
+			status = 1;
+
+	std::vector<result> results;
+	if (!json && !list)
+		printf("%-32s %14s %14s %12s %16s\n", "Benchmark", "Time", "CPU", "Iterations", "Items/s");
+	for (size_t i = 0; i < benchmarks.size(); ++i)
+	{
+		const benchmark &b = benchmarks[i];
+		if (b.name.find(filter) == std::string::npos)
+			continue;
+		if (list)
+		{
+			printf("%s\n", b.name.c_str());
+			continue;
+		}
+		result r = measure_median(b, min_time, repetitions, warmup);
+		results.push_back(r);
+		if (!json)
+		{
+			printf("%-32s %11.1f ns %11.1f ns %12llu", r.name.c_str(), r.real_ns, r.cpu_ns, (unsigned long long)r.iterations);
+			if (r.items_per_second > 0)
+				printf(" %16.4g", r.items_per_second);
+			printf("\n");
+			fflush(stdout);
+		}
+	}
+	if (list)
+		return status;
+
+	if (baseline_out != NULL && !write_baseline(baseline_out, results, frames, ipf))
+	{
+		fprintf(stderr, "%s: cannot write baseline\n", baseline_out);
+		status = 1;
+	}
+	if (baseline != NULL)
+	{
+		int compared = compare_baseline(baseline, results, frames, ipf, threshold, json ? stderr : stdout);
+		if (compared != 0)
+			status = compared;
+	}
+
+	if (json)
+		write_json(stdout, argv[0], results);
+	if (out_path != NULL)
+	{
+		FILE *f = fopen(out_path, "w");
+		if (f == NULL)
+		{
+			fprintf(stderr, "%s: cannot write results\n", out_path);
+			return 1;
+		}
+		write_json(f, argv[0], results);
+		if (fclose(f) != 0)
+			status = 1;
+	}
+	return status;
+}
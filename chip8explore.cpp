@@ -0,0 +1,189 @@
+#include "chip8explore.h"
+
+const uint32_t chip8explore::EMPTY;
+
+static uint64_t hash_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDull;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint64_t hash_bytes(const void *data, size_t size)
+{
+	const uint8_t *p = static_cast<const uint8_t*>(data);
+	uint64_t h = 0x9E3779B97F4A7C15ull ^ size;
+	for (; size >= 8; size -= 8, p += 8)
+	{
+		uint64_t w;
+		memcpy(&w, p, sizeof(w));
+		h = (h ^ w) * 0x100000001B3ull;
+		h ^= h >> 29;
+	}
+	for (; size > 0; --size, ++p)
+		h = (h ^ *p) * 0x100000001B3ull;
+	return hash_mix(h);
+}
+
+chip8explore::chip8explore()
+	: workPage(EMPTY), stepFrames(1), ipf(10), visit(NULL), visitUser(NULL), next(0), dupes(0)
+{
+}
+
+bool chip8explore::init(const chip8 &root, const uint16_t *inputs_, unsigned count, unsigned stepFrames_, unsigned ipf_)
+{
+	if (inputs_ == NULL || count == 0 || count > 256 || stepFrames_ == 0)
+		return false;
+
+	work = root;
+	inputs.assign(inputs_, inputs_ + count);
+	stepFrames = stepFrames_;
+	ipf = ipf_;
+
+	nodes.clear();
+	next = 0;
+	dupes = 0;
+	nodeTable.assign(1024, EMPTY);
+	pageData.clear();
+	pageHash.clear();
+	pageTable.assign(64, EMPTY);
+
+	uint16_t lo, hi;
+	work.takeMemoryWrites(lo, hi);
+	node n;
+	work.fork(n.state);
+	memset(n.state.keypad, 0, sizeof(n.state.keypad));	// each step sets its own
+	n.page = workPage = addPage(static_cast<const uint8_t*>(work.getMemory()));
+	n.parent = 0;
+	n.depth = 0;
+	n.input = 0;
+	n.hash = hash_mix(hash_bytes(&n.state, sizeof(n.state)) ^ n.page);
+	addNode(n);
+	return true;
+}
+
+// Tables are kept at most half full, so probing always ends on an EMPTY slot.
+void chip8explore::tableInsert(std::vector<uint32_t> &table, uint64_t hash, uint32_t index)
+{
+	size_t mask = table.size() - 1;
+	size_t i = hash & mask;
+	while (table[i] != EMPTY)
+		i = (i + 1) & mask;
+	table[i] = index;
+}
+
+uint32_t chip8explore::addPage(const uint8_t *memory)
+{
+	uint64_t hash = hash_bytes(memory, PAGE);
+	size_t mask = pageTable.size() - 1;
+	for (size_t i = hash & mask; pageTable[i] != EMPTY; i = (i + 1) & mask)
+	{
+		uint32_t other = pageTable[i];
+		if (pageHash[other] == hash && memcmp(&pageData[(size_t)other * PAGE], memory, PAGE) == 0)
+			return other;
+	}
+
+	uint32_t index = (uint32_t)pageHash.size();
+	pageData.insert(pageData.end(), memory, memory + PAGE);
+	pageHash.push_back(hash);
+	if (pageHash.size() * 2 > pageTable.size())
+	{
+		pageTable.assign(pageTable.size() * 2, EMPTY);
+		for (uint32_t p = 0; p < pageHash.size(); ++p)
+			tableInsert(pageTable, pageHash[p], p);
+	}
+	else
+		tableInsert(pageTable, hash, index);
+	return index;
+}
+
+bool chip8explore::addNode(const node &n)
+{
+	size_t mask = nodeTable.size() - 1;
+	for (size_t i = n.hash & mask; nodeTable[i] != EMPTY; i = (i + 1) & mask)
+	{
+		const node &other = nodes[nodeTable[i]];
+		if (other.hash == n.hash && other.page == n.page && memcmp(&other.state, &n.state, sizeof(n.state)) == 0)
+		{
+			++dupes;
+			return false;
+		}
+	}
+
+	uint32_t index = (uint32_t)nodes.size();
+	nodes.push_back(n);
+	if (nodes.size() * 2 > nodeTable.size())
+	{
+		nodeTable.assign(nodeTable.size() * 2, EMPTY);
+		for (uint32_t m = 0; m < nodes.size(); ++m)
+			tableInsert(nodeTable, nodes[m].hash, m);
+	}
+	else
+		tableInsert(nodeTable, n.hash, index);
+	return true;
+}
+
+// The working machine keeps its memory between loads and only takes a page
+// when it holds a different one, so siblings that share memory never copy it.
+void chip8explore::load(unsigned index)
+{
+	const node &n = nodes[index];
+	work.resume(n.state);
+	if (workPage != n.page)
+	{
+		work.loadMemory(&pageData[(size_t)n.page * PAGE]);
+		workPage = n.page;
+	}
+	uint16_t lo, hi;
+	work.takeMemoryWrites(lo, hi);
+}
+
+unsigned chip8explore::run(unsigned maxNodes)
+{
+	while (next < nodes.size() && nodes.size() < maxNodes)
+	{
+		unsigned index = next++;
+		load(index);
+		if (!work.run)
+			continue;
+		if (visit != NULL && !visit(index, work, visitUser))
+			continue;
+
+		uint32_t page = nodes[index].page;
+		uint32_t depth = nodes[index].depth + 1;
+		for (unsigned b = 0; b < inputs.size() && nodes.size() < maxNodes; ++b)
+		{
+			if (b > 0)
+				load(index);
+			for (unsigned k = 0; k < 16; ++k)
+				work.keypad[k] = (inputs[b] >> k) & 1;
+			for (unsigned f = 0; f < stepFrames; ++f)
+				work.runFrame(ipf);
+
+			node child;
+			work.fork(child.state);
+			memset(child.state.keypad, 0, sizeof(child.state.keypad));
+			uint16_t lo, hi;
+			if (work.takeMemoryWrites(lo, hi))
+				child.page = workPage = addPage(static_cast<const uint8_t*>(work.getMemory()));
+			else
+				child.page = page;
+			child.parent = index;
+			child.depth = depth;
+			child.input = (uint8_t)b;
+			child.hash = hash_mix(hash_bytes(&child.state, sizeof(child.state)) ^ child.page);
+			addNode(child);
+		}
+	}
+	return (unsigned)nodes.size();
+}
+
+void chip8explore::restore(unsigned index, chip8 &emu) const
+{
+	const node &n = nodes[index];
+	emu.resume(n.state);
+	emu.loadMemory(&pageData[(size_t)n.page * PAGE]);
+}
@@ -0,0 +1,77 @@
+#ifndef CHIP8EXPLORE_H
+#define CHIP8EXPLORE_H
+
+#include "chip8.h"
+
+#include <vector>
+
+// Breadth-first search over input sequences. Every node is a machine state;
+// expanding it runs each of the given inputs for stepFrames frames from that
+// state and adds the children not seen before. States are kept as chip8_fork
+// plus the index of a shared memory page: a child that never wrote to memory
+// points at its parent's page, one that did gets the page holding its memory,
+// and pages are themselves deduplicated. Duplicate states are found by hash
+// and confirmed byte for byte.
+//
+// Expansion uses one working machine and the interpreter. Memory writes are
+// detected through chip8::takeMemoryWrites, which the search consumes.
+class chip8explore
+{
+public:
+	typedef bool (*visit_cb)(unsigned node, const chip8 &emu, void *user);	// emu in node's state; false keeps the node unexpanded
+
+	chip8explore();
+
+	bool init(const chip8 &root, const uint16_t *inputs, unsigned count, unsigned stepFrames, unsigned ipf);	// inputs: keys held, bit k for key k
+	void setVisit(visit_cb cb, void *user) { visit = cb; visitUser = user; }
+
+	unsigned run(unsigned maxNodes);	// expands until maxNodes are known or nothing is left, returns the node count
+
+	unsigned size() const { return (unsigned)nodes.size(); }
+	unsigned expanded() const { return next; }
+	unsigned pages() const { return (unsigned)(pageData.size() / PAGE); }
+	uint64_t duplicates() const { return dupes; }
+
+	unsigned parent(unsigned node) const { return nodes[node].parent; }		// the root is its own parent
+	uint16_t input(unsigned node) const { return inputs[nodes[node].input]; }	// what led here from parent
+	unsigned depth(unsigned node) const { return nodes[node].depth; }
+	void restore(unsigned node, chip8 &emu) const;	// emu must run the same ROM as the root
+
+private:
+	enum { PAGE = 0x1000 };
+	static const uint32_t EMPTY = 0xFFFFFFFF;
+
+	struct node
+	{
+		chip8_fork state;
+		uint64_t hash;
+		uint32_t page;
+		uint32_t parent;
+		uint32_t depth;
+		uint8_t input;
+	};
+
+	void load(unsigned index);
+	uint32_t addPage(const uint8_t *memory);
+	bool addNode(const node &n);
+	static void tableInsert(std::vector<uint32_t> &table, uint64_t hash, uint32_t index);
+
+	chip8 work;
+	uint32_t workPage;		// page work's memory matches
+
+	std::vector<uint16_t> inputs;
+	unsigned stepFrames;
+	unsigned ipf;
+	visit_cb visit;
+	void *visitUser;
+
+	std::vector<node> nodes;	// in breadth-first order
+	unsigned next;				// first node not expanded yet
+	std::vector<uint32_t> nodeTable;	// linear probing on node hash, EMPTY or index into nodes, at most half full
+	std::vector<uint8_t> pageData;
+	std::vector<uint64_t> pageHash;
+	std::vector<uint32_t> pageTable;	// the same on page hash
+	uint64_t dupes;
+};
+
+#endif
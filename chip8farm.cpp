@@ -0,0 +1,209 @@
+#include "chip8farm.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+// Instances [next, end) still to run this epoch. The owner and thieves all
+// take chunks with the same fetch_add, so a shard needs no lock.
+struct alignas(CHIP8_CACHE_LINE) chip8farm::shard
+{
+	std::atomic<unsigned> next;
+	unsigned end;
+};
+
+struct chip8farm::pool
+{
+	std::vector<std::thread> threads;
+	std::mutex lock;
+	std::condition_variable wake;		// a new epoch started, or stopping
+	std::condition_variable done;		// the last helper finished its epoch
+	uint64_t generation;
+	unsigned busy;						// helpers still working on the current epoch
+	bool stopping;
+};
+
+chip8farm::chip8farm()
+	: memory(NULL), slots(NULL), shards(NULL), count(0), nthreads(0), workers(NULL),
+	  input(NULL), inputUser(NULL), epochFrames(60), epoch(NULL), epochUser(NULL),
+	  epochLength(0), epochIpf(0)
+{
+}
+
+chip8farm::~chip8farm()
+{
+	deinit();
+}
+
+bool chip8farm::init(unsigned instances, unsigned threads)
+{
+	deinit();
+	if (instances == 0)
+		return false;
+
+	if (threads == 0)
+		threads = std::thread::hardware_concurrency();
+	if (threads == 0)
+		threads = 1;
+	if (threads > instances)
+		threads = instances;
+
+	// One block, padded so the first slot starts on a cache line. new[] of an
+	// over-aligned type is only guaranteed to honour alignas from C++17 on.
+	size_t slotBytes = sizeof(slot) * instances;
+	memory = malloc(slotBytes + sizeof(shard) * threads + CHIP8_CACHE_LINE);
+	if (memory == NULL)
+		return false;
+	uintptr_t base = ((uintptr_t)memory + CHIP8_CACHE_LINE - 1) & ~(uintptr_t)(CHIP8_CACHE_LINE - 1);
+	slots = reinterpret_cast<slot*>(base);
+	shards = reinterpret_cast<shard*>(base + slotBytes);
+	for (unsigned i = 0; i < instances; ++i)
+	{
+		new (&slots[i]) slot;
+		slots[i].frame = 0;
+	}
+	for (unsigned t = 0; t < threads; ++t)
+		new (&shards[t]) shard;
+	count = instances;
+	nthreads = threads;
+
+	// The calling thread works shard 0, helpers the rest.
+	workers = new pool;
+	workers->generation = 0;
+	workers->busy = 0;
+	workers->stopping = false;
+	try
+	{
+		for (unsigned t = 1; t < threads; ++t)
+			workers->threads.push_back(std::thread([this, t]()
+			{
+				uint64_t seen = 0;
+				for (;;)
+				{
+					{
+						std::unique_lock<std::mutex> lk(workers->lock);
+						workers->wake.wait(lk, [&]() { return workers->stopping || workers->generation != seen; });
+						if (workers->stopping)
+							return;
+						seen = workers->generation;
+					}
+					work(t);
+					std::lock_guard<std::mutex> lk(workers->lock);
+					if (--workers->busy == 0)
+						workers->done.notify_one();
+				}
+			}));
+	}
+	catch (...)
+	{
+		deinit();
+		return false;
+	}
+	return true;
+}
+
+void chip8farm::deinit()
+{
+	if (workers != NULL)
+	{
+		{
+			std::lock_guard<std::mutex> lk(workers->lock);
+			workers->stopping = true;
+		}
+		workers->wake.notify_all();
+		for (size_t t = 0; t < workers->threads.size(); ++t)
+			workers->threads[t].join();
+		delete workers;
+		workers = NULL;
+	}
+
+	for (unsigned i = 0; i < count; ++i)
+		slots[i].~slot();
+	for (unsigned t = 0; t < nthreads; ++t)
+		shards[t].~shard();
+	free(memory);
+	memory = NULL;
+	slots = NULL;
+	shards = NULL;
+	count = 0;
+	nthreads = 0;
+}
+
+void chip8farm::setEpoch(unsigned frames, epoch_cb cb, void *user)
+{
+	epochFrames = frames > 0 ? frames : 1;
+	epoch = cb;
+	epochUser = user;
+}
+
+void chip8farm::runSlot(slot &s)
+{
+	for (unsigned f = 0; f < epochLength; ++f)
+	{
+		if (input != NULL)
+		{
+			uint16_t keys = input((unsigned)(&s - slots), s.frame, inputUser);
+			for (unsigned k = 0; k < 16; ++k)
+				s.emu.keypad[k] = (keys >> k) & 1;
+		}
+		s.emu.runFrame(epochIpf);
+		++s.frame;
+	}
+}
+
+void chip8farm::work(unsigned self)
+{
+	// Own shard first, then the others starting from the next one over, so
+	// thieves spread out instead of all draining the same shard.
+	for (unsigned n = 0; n < nthreads; ++n)
+	{
+		shard &sh = shards[(self + n) % nthreads];
+		for (;;)
+		{
+			unsigned i = sh.next.fetch_add(CHUNK, std::memory_order_relaxed);
+			if (i >= sh.end)
+				break;
+			unsigned last = i + CHUNK < sh.end ? i + CHUNK : sh.end;
+			for (; i < last; ++i)
+				runSlot(slots[i]);
+		}
+	}
+}
+
+unsigned chip8farm::run(unsigned frames, unsigned ipf)
+{
+	if (workers == NULL)
+		return 0;
+
+	unsigned ran = 0;
+	while (ran < frames)
+	{
+		epochLength = frames - ran < epochFrames ? frames - ran : epochFrames;
+		epochIpf = ipf;
+		for (unsigned t = 0; t < nthreads; ++t)
+		{
+			shards[t].next.store((unsigned)((uint64_t)count * t / nthreads), std::memory_order_relaxed);
+			shards[t].end = (unsigned)((uint64_t)count * (t + 1) / nthreads);
+		}
+
+		{
+			std::lock_guard<std::mutex> lk(workers->lock);
+			workers->busy = nthreads - 1;
+			++workers->generation;
+		}
+		workers->wake.notify_all();
+		work(0);
+		{
+			std::unique_lock<std::mutex> lk(workers->lock);
+			workers->done.wait(lk, [&]() { return workers->busy == 0; });
+		}
+
+		ran += epochLength;
+		if (epoch != NULL && !epoch(slots[0].frame, epochUser))
+			break;
+	}
+	return ran;
+}
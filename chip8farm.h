@@ -0,0 +1,70 @@
+#ifndef CHIP8FARM_H
+#define CHIP8FARM_H
+
+#include "chip8.h"
+
+static const size_t CHIP8_CACHE_LINE = 64;
+
+// Batch engine for many independent machines. init() allocates the instances,
+// each on its own cache lines, and starts a pool of worker threads. run()
+// advances every instance in lockstep epochs: each epoch the instances are
+// split into one contiguous shard per thread, a thread works its own shard in
+// small chunks and, once that is empty, steals chunks from the others. All
+// instances finish an epoch before the next one starts, so the epoch callback
+// sees every machine at the same frame.
+class chip8farm
+{
+public:
+	typedef uint16_t (*input_cb)(unsigned instance, unsigned frame, void *user);	// keys held during frame, bit k for key k
+	typedef bool (*epoch_cb)(unsigned frame, void *user);	// frame every instance reached; false stops run()
+
+	chip8farm();
+	~chip8farm();
+
+	bool init(unsigned instances, unsigned threads);	// threads 0 picks the hardware concurrency
+	void deinit();
+
+	void setInput(input_cb cb, void *user) { input = cb; inputUser = user; }
+	void setEpoch(unsigned frames, epoch_cb cb, void *user);	// frames per epoch, the callback runs on the caller of run()
+
+	unsigned run(unsigned frames, unsigned ipf);	// frames every instance advanced
+
+	unsigned size() const { return count; }
+	unsigned threads() const { return nthreads; }
+	chip8 &machine(unsigned i) { return slots[i].emu; }
+	const chip8 &machine(unsigned i) const { return slots[i].emu; }
+	unsigned frame(unsigned i) const { return slots[i].frame; }
+
+private:
+	enum { CHUNK = 4 };		// instances taken from a shard at once
+
+	struct alignas(CHIP8_CACHE_LINE) slot
+	{
+		chip8 emu;
+		unsigned frame;		// frames run since init
+	};
+
+	struct pool;
+	struct shard;
+
+	void work(unsigned self);
+	void runSlot(slot &s);
+
+	void *memory;			// raw allocation holding slots and shards
+	slot *slots;
+	shard *shards;
+	unsigned count;
+	unsigned nthreads;
+	pool *workers;
+
+	input_cb input;
+	void *inputUser;
+	unsigned epochFrames;
+	epoch_cb epoch;
+	void *epochUser;
+
+	unsigned epochLength;	// frames each instance runs in the current epoch
+	unsigned epochIpf;
+};
+
+#endif
@@ -0,0 +1,640 @@
+#include "chip8jit.h"
+
+#include <stddef.h>
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define CHIP8JIT_X64
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static const size_t CODE_SIZE = 1024 * 1024;
+
+enum
+{
+	INSN_PLAIN,
+	INSN_JUMP,
+	INSN_SKIP
+};
+
+static const int REG_I = 16;	// I gets a host register like V0-VF do, as bit 16 of the masks below
+
+// Registers a translatable instruction touches (V0-VF, I) and writes, and what
+// kind of instruction it is. False for instructions left to the interpreter.
+static bool classify(const chip8_insn &in, uint16_t addr, uint32_t &uses, uint32_t &writes, int &kind)
+{
+	uses = 0;
+	writes = 0;
+	kind = INSN_PLAIN;
+	switch (in.op)
+	{
+	case CHIP8_OP_LD_BYTE: case CHIP8_OP_ADD_BYTE: case CHIP8_OP_LD_VX_DT:
+		uses = writes = 1 << in.x;
+		return true;
+	case CHIP8_OP_LD_REG: case CHIP8_OP_OR: case CHIP8_OP_AND: case CHIP8_OP_XOR:
+		uses = 1 << in.x | 1 << in.y;
+		writes = 1 << in.x;
+		return true;
+	case CHIP8_OP_ADD_REG: case CHIP8_OP_SUB: case CHIP8_OP_SUBN:
+		uses = 1 << in.x | 1 << in.y | 1 << 0xF;
+		writes = 1 << in.x | 1 << 0xF;
+		return in.x != 0xF && in.y != 0xF;	// VF aliasing is left to the interpreter
+	case CHIP8_OP_SHR: case CHIP8_OP_SHL:
+		uses = writes = 1 << in.x | 1 << 0xF;
+		return in.x != 0xF;
+	case CHIP8_OP_LD_I:
+		uses = writes = 1 << REG_I;
+		return true;
+	case CHIP8_OP_ADD_I:
+		uses = 1 << in.x | 1 << 0xF | 1 << REG_I;
+		writes = 1 << 0xF | 1 << REG_I;
+		return in.x != 0xF;
+	case CHIP8_OP_JP:
+		kind = INSN_JUMP;
+		return in.nnn != addr;	// keep the interpreter's infinite loop detection
+	case CHIP8_OP_SE_BYTE: case CHIP8_OP_SNE_BYTE: case CHIP8_OP_SKP: case CHIP8_OP_SKNP:
+		uses = 1 << in.x;
+		kind = INSN_SKIP;
+		return true;
+	case CHIP8_OP_SE_REG: case CHIP8_OP_SNE_REG:
+		uses = 1 << in.x | 1 << in.y;
+		kind = INSN_SKIP;
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool transfers_control(uint8_t op)
+{
+	switch (op)
+	{
+	case CHIP8_OP_JP: case CHIP8_OP_CALL: case CHIP8_OP_RET: case CHIP8_OP_JP_V0:
+	case CHIP8_OP_SE_BYTE: case CHIP8_OP_SNE_BYTE: case CHIP8_OP_SE_REG: case CHIP8_OP_SNE_REG:
+	case CHIP8_OP_SKP: case CHIP8_OP_SKNP: case CHIP8_OP_LD_VX_K:
+	case CHIP8_OP_SCHIP: case CHIP8_OP_UNKNOWN:
+		return true;
+	default:
+		return false;
+	}
+}
+
+#ifdef CHIP8JIT_X64
+enum
+{
+	EAX = 0, ECX, EDX, EBX, ESP, EBP, ESI, EDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Host registers handed out to V0-VF and I, caller-saved ones first.
+// rdi holds the context, rsi the V array and eax is scratch.
+static const uint8_t reg_pool[] = { ECX, EDX, R8, R9, R10, R11, EBX, EBP, R12, R13, R14, R15 };
+static const unsigned POOL_SIZE = sizeof(reg_pool);
+
+static bool callee_saved(int reg)
+{
+	return reg == EBX || reg == EBP || reg >= R12;
+}
+
+static unsigned count_fresh(const int reg[], uint32_t mask)
+{
+	unsigned fresh = 0;
+	for (int r = 0; r <= REG_I; ++r)
+		if ((mask >> r) & 1 && reg[r] < 0)
+			++fresh;
+	return fresh;
+}
+
+enum { OP_ADD = 0x01, OP_OR = 0x09, OP_AND = 0x21, OP_SUB = 0x29, OP_XOR = 0x31, OP_CMP = 0x39, OP_MOV = 0x89 };
+enum { DIGIT_ADD = 0, DIGIT_AND = 4, DIGIT_XOR = 6, DIGIT_CMP = 7, DIGIT_SHL = 4, DIGIT_SHR = 5 };
+enum { JE = 0x74, JNE = 0x75 };
+
+// Minimal x86-64 encoder for the handful of instructions blocks need. Guest
+// registers live zero-extended in 32-bit host registers.
+struct emitter
+{
+	uint8_t *p;
+
+	explicit emitter(uint8_t *p_) : p(p_) {}
+
+	void byte(uint8_t b) { *p++ = b; }
+	void dword(uint32_t v) { memcpy(p, &v, sizeof(v)); p += sizeof(v); }
+	void modrm(int mod, int reg, int rm) { byte((mod << 6) | ((reg & 7) << 3) | (rm & 7)); }
+	void rex(int reg, int rm, bool force)
+	{
+		uint8_t r = 0x40 | ((reg >> 3) << 2) | (rm >> 3);
+		if (r != 0x40 || force)
+			byte(r);
+	}
+
+	void alu_rr(uint8_t opcode, int dst, int src) { rex(src, dst, false); byte(opcode); modrm(3, src, dst); }	// op dst, src
+	void alu_ri(int digit, int dst, uint32_t imm) { rex(0, dst, false); byte(0x81); modrm(3, digit, dst); dword(imm); }	// op dst, imm32
+	void mov_ri(int dst, uint32_t imm) { rex(0, dst, false); byte(0xB8 + (dst & 7)); dword(imm); }
+	void shift_ri(int digit, int dst, uint8_t n) { rex(0, dst, false); byte(0xC1); modrm(3, digit, dst); byte(n); }
+	void test_eax() { byte(0x85); modrm(3, EAX, EAX); }
+	void seta_al() { byte(0x0F); byte(0x97); modrm(3, 0, EAX); }
+	void movzx_al(int dst) { rex(dst, EAX, false); byte(0x0F); byte(0xB6); modrm(3, dst, EAX); }
+
+	// V array through rsi
+	void load_v(int dst, uint8_t idx) { rex(dst, ESI, false); byte(0x0F); byte(0xB6); modrm(1, dst, ESI); byte(idx); }	// movzx dst, byte [rsi + idx]
+	void store_v(uint8_t idx, int src) { rex(src, ESI, true); byte(0x88); modrm(1, src, ESI); byte(idx); }	// mov byte [rsi + idx], src8
+
+	// context fields through rdi
+	void load_ptr(int dst, uint8_t disp) { byte(0x48 | ((dst >> 3) << 2)); byte(0x8B); modrm(1, dst, EDI); byte(disp); }	// mov dst64, [rdi + disp]
+	void load_ctx8(int dst, uint8_t disp) { rex(dst, EDI, false); byte(0x0F); byte(0xB6); modrm(1, dst, EDI); byte(disp); }
+	void load_ctx16(int dst, uint8_t disp) { rex(dst, EDI, false); byte(0x0F); byte(0xB7); modrm(1, dst, EDI); byte(disp); }
+	void store_ctx16(uint8_t disp, int src) { byte(0x66); rex(src, EDI, false); byte(0x89); modrm(1, src, EDI); byte(disp); }
+	void load_ctx32_eax(uint8_t disp) { byte(0x8B); modrm(1, EAX, EDI); byte(disp); }
+	void sub_eax_ctx32(uint8_t disp) { byte(0x2B); modrm(1, EAX, EDI); byte(disp); }
+	void add_ctx32(uint8_t disp, int8_t imm) { byte(0x83); modrm(1, 0, EDI); byte(disp); byte(imm); }
+
+	// movzx eax, byte [rax + index]
+	void load_indexed_eax(int index)
+	{
+		if (index >= R8)
+			byte(0x42);
+		byte(0x0F);
+		byte(0xB6);
+		modrm(0, EAX, ESP);	// SIB follows
+		byte(((index & 7) << 3) | EAX);
+	}
+
+	uint8_t *jcc8(uint8_t opcode) { byte(opcode); byte(0); return p - 1; }
+	uint8_t *jmp8() { byte(0xEB); byte(0); return p - 1; }
+	uint8_t *jmp32() { byte(0xE9); dword(0); return p - 4; }
+	void jae32(const uint8_t *target) { byte(0x0F); byte(0x83); dword((uint32_t)(target - (p + 4))); }
+	void bind8(uint8_t *patch) { *patch = (uint8_t)(p - (patch + 1)); }
+	void bind32(uint8_t *patch) { uint32_t rel = (uint32_t)(p - (patch + 4)); memcpy(patch, &rel, sizeof(rel)); }
+
+	void push(int reg) { if (reg >= R8) byte(0x41); byte(0x50 + (reg & 7)); }
+	void pop(int reg) { if (reg >= R8) byte(0x41); byte(0x58 + (reg & 7)); }
+	void ret() { byte(0xC3); }
+};
+
+// Emitter for one block, keeping track of its exits. Every exit adds the
+// instructions listed up to it to ctx->executed; a taken inlined skip takes
+// back the one it jumped over.
+struct block_emitter : emitter
+{
+	uint16_t addr;			// guest address of the block
+	const uint8_t *top;		// loop head, NULL when the block must not loop
+	uint8_t *exits[chip8jit::MAX_BLOCK_INSNS + 1];
+	uint8_t *lengths[chip8jit::MAX_BLOCK_INSNS + 1];
+	unsigned nexits;
+	unsigned nlengths;
+
+	block_emitter(uint8_t *p_, uint16_t addr_)
+		: emitter(p_), addr(addr_), top(NULL), nexits(0), nlengths(0) {}
+
+	void exit(uint16_t target, unsigned listed)
+	{
+		add_ctx32(offsetof(chip8jit::context, executed), listed);
+		if (target == addr && top != NULL)
+		{
+			// Go round again while a whole pass still fits the budget.
+			load_ctx32_eax(offsetof(chip8jit::context, budget));
+			sub_eax_ctx32(offsetof(chip8jit::context, executed));
+			alu_ri(DIGIT_CMP, EAX, 0);
+			lengths[nlengths++] = p - 4;
+			jae32(top);
+		}
+		mov_ri(EAX, target);
+		exits[nexits++] = jmp32();
+	}
+
+	// Flags for a skip; returns the jcc taken when the skip is not.
+	uint8_t test(const chip8_insn &in, const int reg[])
+	{
+		switch (in.op)
+		{
+		case CHIP8_OP_SE_BYTE:
+			alu_ri(DIGIT_CMP, reg[in.x], in.nn);
+			return JNE;
+		case CHIP8_OP_SNE_BYTE:
+			alu_ri(DIGIT_CMP, reg[in.x], in.nn);
+			return JE;
+		case CHIP8_OP_SE_REG:
+			alu_rr(OP_CMP, reg[in.x], reg[in.y]);
+			return JNE;
+		case CHIP8_OP_SNE_REG:
+			alu_rr(OP_CMP, reg[in.x], reg[in.y]);
+			return JE;
+		default: // SKP, SKNP
+			load_ptr(EAX, offsetof(chip8jit::context, keypad));
+			load_indexed_eax(reg[in.x]);
+			test_eax();
+			return in.op == CHIP8_OP_SKP ? JE : JNE;
+		}
+	}
+
+	void plain(const chip8_insn &in, const int reg[])
+	{
+		int rx = reg[in.x];
+		int ry = reg[in.y];
+		int rf = reg[0xF];
+		int ri = reg[REG_I];
+		switch (in.op)
+		{
+		case CHIP8_OP_LD_BYTE:
+			mov_ri(rx, in.nn);
+			break;
+		case CHIP8_OP_ADD_BYTE:
+			alu_ri(DIGIT_ADD, rx, in.nn);
+			alu_ri(DIGIT_AND, rx, 0xFF);
+			break;
+		case CHIP8_OP_LD_REG:
+			alu_rr(OP_MOV, rx, ry);
+			break;
+		case CHIP8_OP_OR:
+			alu_rr(OP_OR, rx, ry);
+			break;
+		case CHIP8_OP_AND:
+			alu_rr(OP_AND, rx, ry);
+			break;
+		case CHIP8_OP_XOR:
+			alu_rr(OP_XOR, rx, ry);
+			break;
+		case CHIP8_OP_ADD_REG: // the 9-bit sum's top bit is the carry
+			alu_rr(OP_ADD, rx, ry);
+			alu_rr(OP_MOV, rf, rx);
+			shift_ri(DIGIT_SHR, rf, 8);
+			alu_ri(DIGIT_AND, rx, 0xFF);
+			break;
+		case CHIP8_OP_SUB: // VF = no borrow = sign bit of the 32-bit difference, inverted
+			alu_rr(OP_SUB, rx, ry);
+			alu_rr(OP_MOV, rf, rx);
+			shift_ri(DIGIT_SHR, rf, 31);
+			alu_ri(DIGIT_XOR, rf, 1);
+			alu_ri(DIGIT_AND, rx, 0xFF);
+			break;
+		case CHIP8_OP_SUBN:
+			alu_rr(OP_MOV, EAX, ry);
+			alu_rr(OP_SUB, EAX, rx);
+			alu_rr(OP_MOV, rf, EAX);
+			shift_ri(DIGIT_SHR, rf, 31);
+			alu_ri(DIGIT_XOR, rf, 1);
+			alu_ri(DIGIT_AND, EAX, 0xFF);
+			alu_rr(OP_MOV, rx, EAX);
+			break;
+		case CHIP8_OP_SHR:
+			alu_rr(OP_MOV, rf, rx);
+			alu_ri(DIGIT_AND, rf, 1);
+			shift_ri(DIGIT_SHR, rx, 1);
+			break;
+		case CHIP8_OP_SHL:
+			alu_rr(OP_MOV, rf, rx);
+			shift_ri(DIGIT_SHR, rf, 7);
+			shift_ri(DIGIT_SHL, rx, 1);
+			alu_ri(DIGIT_AND, rx, 0xFF);
+			break;
+		case CHIP8_OP_LD_I:
+			mov_ri(ri, in.nnn);
+			break;
+		case CHIP8_OP_ADD_I:
+			alu_rr(OP_ADD, ri, rx);
+			alu_ri(DIGIT_CMP, ri, 0xFFF);
+			seta_al();
+			movzx_al(rf);
+			alu_ri(DIGIT_AND, ri, 0xFFFF);
+			break;
+		case CHIP8_OP_LD_VX_DT:
+			load_ctx8(rx, offsetof(chip8jit::context, delay));
+			break;
+		}
+	}
+};
+#endif
+
+#ifdef CHIP8JIT_X64
+// The code cache is W^X: read and execute, except for the pages a block is
+// being emitted into, which are read and write until it is done.
+static bool protect(uint8_t *p, size_t size, int prot)
+{
+	static const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t lo = (uintptr_t)p & ~(page - 1);
+	uintptr_t hi = ((uintptr_t)p + size + page - 1) & ~(page - 1);
+	return mprotect(reinterpret_cast<void*>(lo), hi - lo, prot) == 0;
+}
+#endif
+
+chip8jit::chip8jit()
+	: code(NULL), codeSize(0), codeUsed(0), compiled(0)
+{
+	memset(blocks, 0, sizeof(blocks));
+	memset(known, 0, sizeof(known));
+}
+
+chip8jit::~chip8jit()
+{
+	deinit();
+}
+
+bool chip8jit::init()
+{
+	deinit();
+#ifdef CHIP8JIT_X64
+	void *mem = mmap(NULL, CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return false;
+	code = static_cast<uint8_t*>(mem);
+	codeSize = CODE_SIZE;
+	flush();
+	return true;
+#else
+	return false;
+#endif
+}
+
+void chip8jit::deinit()
+{
+#ifdef CHIP8JIT_X64
+	if (code != NULL)
+		munmap(code, codeSize);
+#endif
+	code = NULL;
+	codeSize = 0;
+	flush();
+}
+
+void chip8jit::flush()
+{
+	memset(known, 0, sizeof(known));
+	codeUsed = 0;
+}
+
+void chip8jit::invalidate(uint16_t lo, uint16_t hi)
+{
+	unsigned start = lo > 2 * MAX_BLOCK_INSNS ? lo - 2 * MAX_BLOCK_INSNS : 0;
+	for (unsigned addr = start; addr < hi; ++addr)
+	{
+		unsigned extent = blocks[addr].bytes > 2 ? blocks[addr].bytes : 2;
+		if (known[addr] && addr + extent > lo)
+			known[addr] = false;
+	}
+}
+
+void chip8jit::compile(chip8 &emu, uint16_t addr)
+{
+	if (code != NULL && codeSize - codeUsed < MAX_BLOCK_CODE)
+		flush();
+
+	known[addr] = true;
+	blocks[addr].fn = NULL;
+	blocks[addr].length = 1;
+	blocks[addr].bytes = 0;
+	blocks[addr].timerRead = NO_TIMER_READ;
+
+	// Where nothing can be translated, hand the interpreter the whole straight
+	// run up to the next control transfer or translatable instruction.
+	chip8_insn in;
+	uint32_t uses, writes;
+	int kind;
+	emu.decode(addr, in);
+	if (code == NULL || !classify(in, addr, uses, writes, kind))
+	{
+		unsigned n = 1;
+		for (uint16_t a = addr + 2; n < MAX_BLOCK_INSNS && a < 0xFFF && !transfers_control(in.op); a += 2, ++n)
+		{
+			emu.decode(a, in);
+			if (classify(in, a, uses, writes, kind))
+				break;
+		}
+		blocks[addr].length = n;
+		return;
+	}
+
+#ifdef CHIP8JIT_X64
+	// Pass 1: find how far the block goes and which registers it needs. A skip
+	// over a translatable instruction other than another skip is inlined and
+	// the block carries on after it; any other skip, or an unguarded jump, ends it.
+	chip8_insn insns[MAX_BLOCK_INSNS];
+	bool guards[MAX_BLOCK_INSNS];	// insns[i] is a skip inlined over insns[i + 1]
+	int reg[REG_I + 1];
+	uint32_t written = 0;
+	unsigned nregs = 0;
+	unsigned n = 0;
+	bool terminated = false;
+	bool guarded = false;
+	uint8_t timerRead = NO_TIMER_READ;
+	for (int r = 0; r <= REG_I; ++r)
+		reg[r] = -1;
+
+	for (uint16_t a = addr; n < MAX_BLOCK_INSNS && a < 0xFFF; a += 2)
+	{
+		emu.decode(a, in);
+		if (!classify(in, a, uses, writes, kind))
+			break;
+
+		bool guard = false;
+		if (kind == INSN_SKIP && n + 2 <= MAX_BLOCK_INSNS && a + 2 < 0xFFF)
+		{
+			chip8_insn next;
+			uint32_t nextUses, nextWrites;
+			int nextKind;
+			emu.decode(a + 2, next);
+			guard = classify(next, a + 2, nextUses, nextWrites, nextKind) && nextKind != INSN_SKIP
+				&& nregs + count_fresh(reg, uses | nextUses) <= POOL_SIZE;
+			if (guard)
+				uses |= nextUses;
+		}
+		if (nregs + count_fresh(reg, uses) > POOL_SIZE)
+			break;
+		for (int r = 0; r <= REG_I; ++r)
+			if ((uses >> r) & 1 && reg[r] < 0)
+				reg[r] = reg_pool[nregs++];
+
+		if (in.op == CHIP8_OP_LD_VX_DT)
+			timerRead = n;
+		written |= writes;
+		guards[n] = guard;
+		insns[n++] = in;
+		if ((kind == INSN_SKIP && !guard) || (kind == INSN_JUMP && !guarded))
+		{
+			terminated = true;
+			break;
+		}
+		guarded = guard;
+	}
+
+	// Pass 2: emit. compile() left at least MAX_BLOCK_CODE free past start.
+	uint8_t *start = code + codeUsed;
+	if (!protect(start, MAX_BLOCK_CODE, PROT_READ | PROT_WRITE))
+		return;	// interpreted, as a NULL block
+	block_emitter e(start, addr);
+
+	for (unsigned i = 0; i < nregs; ++i)
+		if (callee_saved(reg_pool[i]))
+			e.push(reg_pool[i]);
+	e.load_ptr(ESI, offsetof(context, V));
+	for (int r = 0; r < 16; ++r)
+		if (reg[r] >= 0)
+			e.load_v(reg[r], r);
+	if (reg[REG_I] >= 0)
+		e.load_ctx16(reg[REG_I], offsetof(context, I));
+	if (timerRead == NO_TIMER_READ) // the delay timer does not move inside a call
+		e.top = e.p;
+
+	for (unsigned i = 0; i < n; ++i)
+	{
+		const chip8_insn &in = insns[i];
+		uint16_t pc = addr + 2 * i;
+		if (in.op == CHIP8_OP_JP)
+		{
+			e.exit(in.nnn, i + 1);
+		}
+		else if (classify(in, pc, uses, writes, kind) && kind == INSN_SKIP)
+		{
+			uint8_t runs = e.test(in, reg);
+			if (guards[i])
+			{
+				uint8_t *next = e.jcc8(runs);
+				e.add_ctx32(offsetof(context, executed), -1);
+				uint8_t *after = e.jmp8();
+				e.bind8(next);
+				++i;
+				if (insns[i].op == CHIP8_OP_JP)
+					e.exit(insns[i].nnn, i + 1);
+				else
+					e.plain(insns[i], reg);
+				e.bind8(after);
+			}
+			else
+			{
+				e.mov_ri(EAX, pc + 2);
+				e.byte(runs);
+				e.byte(5);	// over the next mov
+				e.mov_ri(EAX, pc + 4);
+				e.add_ctx32(offsetof(context, executed), i + 1);
+				e.exits[e.nexits++] = e.jmp32();
+			}
+		}
+		else
+		{
+			e.plain(in, reg);
+		}
+	}
+	if (!terminated)
+		e.exit(addr + 2 * n, n);
+
+	for (unsigned i = 0; i < e.nexits; ++i)
+		e.bind32(e.exits[i]);
+	for (unsigned i = 0; i < e.nlengths; ++i)
+		memcpy(e.lengths[i], &n, sizeof(uint32_t));
+	for (int r = 0; r < 16; ++r)
+		if ((written >> r) & 1)
+			e.store_v(r, reg[r]);
+	if ((written >> REG_I) & 1)
+		e.store_ctx16(offsetof(context, I), reg[REG_I]);
+	for (unsigned i = nregs; i-- > 0; )
+		if (callee_saved(reg_pool[i]))
+			e.pop(reg_pool[i]);
+	e.ret();
+
+	if (!protect(start, MAX_BLOCK_CODE, PROT_READ | PROT_EXEC))
+	{
+		deinit();	// blocks sharing these pages cannot run any more, interpret from here on
+		known[addr] = true;
+		return;
+	}
+	codeUsed += e.p - start;
+	blocks[addr].fn = reinterpret_cast<block_fn>(start);
+	blocks[addr].length = n;
+	blocks[addr].bytes = 2 * n;
+	blocks[addr].timerRead = timerRead;
+	++compiled;
+#endif
+}
+
+void chip8jit::interpret(chip8 &emu, unsigned count, bool frameTimers)
+{
+	if (frameTimers)
+		emu.execute<false>(count);
+	else
+		emu.execute<true>(count);
+}
+
+unsigned chip8jit::run(chip8 &emu, unsigned count)
+{
+	return execute(emu, count, false);
+}
+
+unsigned chip8jit::runFrame(chip8 &emu, unsigned ipf)
+{
+	unsigned done = execute(emu, ipf, true);
+	emu.runTimers();
+	return done;
+}
+
+unsigned chip8jit::execute(chip8 &emu, unsigned count, bool frameTimers)
+{
+	context ctx;
+	ctx.V = emu.V;
+	ctx.keypad = emu.keypad;
+
+	unsigned done = 0;
+	uint16_t lo, hi;
+	while (done < count && emu.run)
+	{
+		if (emu.takeMemoryWrites(lo, hi))
+			invalidate(lo, hi);
+
+		uint16_t pc = emu.pc;
+		if (pc < 0x1000)
+		{
+			if (!known[pc])
+				compile(emu, pc);
+
+			const block &b = blocks[pc];
+			if (b.fn == NULL)
+			{
+				unsigned steps = b.length < count - done ? b.length : count - done;
+				interpret(emu, steps, frameTimers);
+				done += steps;
+				continue;
+			}
+			if (b.length > count - done)
+			{
+				// Too little budget left for a full pass, finish the call interpreting.
+				interpret(emu, count - done, frameTimers);
+				return count;
+			}
+			// FX07 reads the delay timer as it was on entry, so no tick may fall before it.
+			if (frameTimers || b.timerRead == NO_TIMER_READ || emu.frm + b.timerRead < 9)
+			{
+				ctx.executed = 0;
+				ctx.budget = count - done;
+				ctx.I = emu.I;
+				ctx.delay = emu.delay_timer;
+				emu.pc = b.fn(&ctx);
+				emu.I = ctx.I;
+				emu.retiredCount += ctx.executed;
+				done += ctx.executed;
+				if (frameTimers)
+					continue;
+
+				// Blocks never touch the timers, so the ticks that fell inside can be applied after it.
+				unsigned frm = emu.frm;
+				unsigned ticks;
+				if (frm >= 9) // left over from FX0A waiting, the first instruction ticks
+				{
+					ticks = 1 + (ctx.executed - 1) / 9;
+					frm = (ctx.executed - 1) % 9;
+				}
+				else
+				{
+					ticks = (frm + ctx.executed) / 9;
+					frm = (frm + ctx.executed) % 9;
+				}
+				emu.frm = frm;
+				while (ticks-- > 0)
+					emu.runTimers();
+				continue;
+			}
+		}
+
+		interpret(emu, 1, frameTimers);
+		++done;
+	}
+	return done;
+}
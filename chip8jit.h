@@ -0,0 +1,76 @@
+#ifndef CHIP8JIT_H
+#define CHIP8JIT_H
+
+#include "chip8.h"
+
+// x86-64 block translator for chip8. Straight-line runs of ALU instructions
+// (6XNN, 7XNN, 8XYN, ANNN, FX1E), key and delay timer reads and the skips and
+// jumps between them are compiled into native code that keeps the V registers
+// and I in host registers. A skip over a translatable instruction stays inside
+// the block, and a block that jumps back to its own start loops natively.
+// Everything else, and anything the translator is unsure about, is left to the
+// interpreter, which stays the reference: run() and runFrame() give the same
+// machine state as the chip8 calls they mirror.
+//
+// Blocks are cached per start address. Memory writes reported by
+// chip8::takeMemoryWrites (FX33/FX55, loads, unserialize) drop every block
+// overlapping the written range before the next dispatch. The code cache is
+// never writable and executable at once.
+class chip8jit
+{
+public:
+	chip8jit();
+	~chip8jit();
+
+	bool init();			// false when executable memory is unavailable, run() then only interprets
+	void deinit();
+	void flush();
+
+	unsigned run(chip8 &emu, unsigned count);			// same as emu.emulateCycles(count)
+	unsigned runFrame(chip8 &emu, unsigned ipf);		// same as emu.runFrame(ipf)
+
+	unsigned blocksCompiled() const { return compiled; }
+
+private:
+	friend struct block_emitter;
+
+	// What a block sees of the machine. Blocks add the instructions they retire
+	// to executed and loop back on themselves while budget allows.
+	struct context
+	{
+		uint8_t *V;
+		const uint8_t *keypad;
+		uint32_t executed;
+		uint32_t budget;
+		uint16_t I;
+		uint8_t delay;
+	};
+	typedef uint16_t (*block_fn)(context *ctx);	// returns the next pc
+
+	enum { MAX_BLOCK_INSNS = 64 };
+	enum { MAX_BLOCK_CODE = 4096 };	// generous upper bound on one block's machine code
+	enum { NO_TIMER_READ = 0xFF };
+
+	struct block
+	{
+		block_fn fn;		// NULL when the address starts with an instruction the translator does not handle
+		uint8_t length;		// most instructions one pass retires; for NULL blocks, how many to interpret
+		uint8_t bytes;		// chip8 memory covered
+		uint8_t timerRead;	// index of the last FX07, the delay timer must not tick before it
+	};
+
+	unsigned execute(chip8 &emu, unsigned count, bool frameTimers);
+	static void interpret(chip8 &emu, unsigned count, bool frameTimers);
+	void compile(chip8 &emu, uint16_t addr);
+	void invalidate(uint16_t lo, uint16_t hi);
+
+	uint8_t *code;
+	size_t codeSize;
+	size_t codeUsed;
+
+	block blocks[0x1000];
+	bool known[0x1000];	// blocks[addr] holds a translation attempt
+	unsigned compiled;
+};
+
+#endif
@@ -0,0 +1,438 @@
+#include "chip8lanes.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CHIP8LANES_X86
+#include <immintrin.h>
+#endif
+
+// Vector masks are all ones in selected lanes. LANE_BITS turns a lane bitmask
+// into a 16-bit mask, __builtin_convertvector narrows that for byte fields.
+#define LANE_BITS { 0x0001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080, \
+	0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4000, 0x8000 }
+
+chip8lanes::chip8lanes()
+	: runMask(0), haveImage(false), stepCount(0), insnCount(0)
+{
+	memset(V, 0, sizeof(V));
+	I = pc = keys16 = u16x16();
+	sp = delay_timer = sound_timer = u8x16();
+	rng = u32x16() + CHIP8_DEFAULT_SEED;
+	memset(stack, 0, sizeof(stack));
+	memset(memory, 0, sizeof(memory));
+	memset(gfx, 0, sizeof(gfx));
+	memset(image, 0, sizeof(image));
+	memset(diverged, 0, sizeof(diverged));
+	memset(decoded, 0, sizeof(decoded)); // CHIP8_OP_UNDECODED
+	memset(decodedOpcode, 0, sizeof(decodedOpcode));
+	memset(retiredCount, 0, sizeof(retiredCount));
+}
+
+bool chip8lanes::load(unsigned lane, const chip8 &emu)
+{
+	chip8_savestate state;
+	if (lane >= LANES || !emu.serialize(&state, sizeof(state)))
+		return false;
+
+	pc[lane] = state.pc;
+	I[lane] = state.I;
+	sp[lane] = (uint8_t)state.sp;
+	memcpy(stack[lane], state.stack, sizeof(stack[lane]));
+	for (unsigned r = 0; r < 16; ++r)
+		V[r][lane] = state.V[r];
+	delay_timer[lane] = state.delay_timer;
+	sound_timer[lane] = state.sound_timer;
+	rng[lane] = state.rng;
+
+	uint16_t keys = 0;
+	for (unsigned k = 0; k < 16; ++k)
+		if (state.keypad[k] != 0)
+			keys |= 1u << k;
+	keys16[lane] = keys;
+	memcpy(gfx[lane], state.gfx, sizeof(gfx[lane]));
+
+	memcpy(memory[lane], state.memory, sizeof(memory[lane]));
+	if (!haveImage)
+	{
+		memcpy(image, state.memory, sizeof(image));
+		haveImage = true;
+	}
+	for (unsigned addr = 0; addr < sizeof(image); ++addr)
+		if (image[addr] != state.memory[addr])
+			diverged[addr] = 1;
+
+	if (state.run)
+		runMask |= 1u << lane;
+	else
+		runMask &= ~(1u << lane);
+	retiredCount[lane] = 0;
+	return true;
+}
+
+// frm only drives instruction-timer mode, which lanes do not have, so the
+// lane's value is not tracked and the stored machine keeps its own.
+bool chip8lanes::store(unsigned lane, chip8 &emu) const
+{
+	chip8_savestate state;
+	if (lane >= LANES || !emu.serialize(&state, sizeof(state)))
+		return false;
+
+	state.pc = pc[lane];
+	state.I = I[lane];
+	state.sp = sp[lane];
+	memcpy(state.stack, stack[lane], sizeof(state.stack));
+	for (unsigned r = 0; r < 16; ++r)
+		state.V[r] = V[r][lane];
+	state.delay_timer = delay_timer[lane];
+	state.sound_timer = sound_timer[lane];
+	state.rng = rng[lane];
+	state.run = running(lane);
+	for (unsigned k = 0; k < 16; ++k)
+		state.keypad[k] = (keys16[lane] >> k) & 1;
+	memcpy(state.gfx, gfx[lane], sizeof(state.gfx));
+	memcpy(state.memory, memory[lane], sizeof(state.memory));
+	return emu.unserialize(&state, sizeof(state));
+}
+
+uint16_t chip8lanes::fetchOpcode(unsigned lane, uint16_t addr) const
+{
+	return memory[lane][addr & 0xFFF] << 8 | memory[lane][(addr + 1) & 0xFFF];
+}
+
+// The interpreter loop is built twice on x86, once for the baseline and once
+// with AVX2 where each 16-bit field fits a single register, and picked at
+// run time like the video converters do.
+struct lanes_kernel
+{
+	typedef chip8lanes::u8x16 u8x16;
+	typedef chip8lanes::s8x16 s8x16;
+	typedef chip8lanes::u16x16 u16x16;
+	typedef chip8lanes::s16x16 s16x16;
+	typedef chip8lanes::u32x16 u32x16;
+	typedef chip8lanes::s32x16 s32x16;
+
+	static inline __attribute__((always_inline)) uint32_t lane_bits(const s16x16 &m);
+	static inline __attribute__((always_inline)) uint32_t step(chip8lanes &l, const chip8_insn &insn, uint32_t group, const s16x16 &m16);
+	static inline __attribute__((always_inline)) void burst(chip8lanes &l, unsigned ipf);
+
+	static void burst_generic(chip8lanes &l, unsigned ipf) { burst(l, ipf); }
+#ifdef CHIP8LANES_X86
+	__attribute__((target("avx2"))) static void burst_avx2(chip8lanes &l, unsigned ipf) { burst(l, ipf); }
+#endif
+
+	typedef void (*burst_fn)(chip8lanes &l, unsigned ipf);
+	static burst_fn pick()
+	{
+#ifdef CHIP8LANES_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			return burst_avx2;
+#endif
+		return burst_generic;
+	}
+};
+
+void chip8lanes::runFrame(unsigned ipf)
+{
+	static void (*const impl)(chip8lanes &l, unsigned ipf) = lanes_kernel::pick();	// thread-safe static init
+	impl(*this, ipf);
+
+	delay_timer -= (u8x16)(delay_timer != 0) & 1;
+	sound_timer -= (u8x16)(sound_timer != 0) & 1;
+}
+
+// Lane bitmask of the lanes whose 16-bit mask element is all ones.
+uint32_t lanes_kernel::lane_bits(const s16x16 &m)
+{
+#ifdef CHIP8LANES_X86
+	s8x16 narrow = __builtin_convertvector(m, s8x16);
+	__m128i bytes;
+	memcpy(&bytes, &narrow, sizeof(bytes));
+	return (uint32_t)_mm_movemask_epi8(bytes);
+#else
+	uint32_t bits = 0;
+	for (unsigned lane = 0; lane < chip8lanes::LANES; ++lane)
+		bits |= (uint32_t)(m[lane] & 1) << lane;
+	return bits;
+#endif
+}
+
+// Budgets are counted in 16-bit lanes, so long bursts run in chunks of at most
+// 0xFFFF instructions. Lanes are independent, how their steps interleave does
+// not change what each one computes.
+void lanes_kernel::burst(chip8lanes &l, unsigned ipf)
+{
+	static const u16x16 laneBit = LANE_BITS;
+	uint32_t waitingAll = 0;	// lanes done with this burst on FX0A
+	for (unsigned left = ipf; left > 0; )
+	{
+		uint16_t chunk = left < 0xFFFF ? left : 0xFFFF;
+		left -= chunk;
+		u16x16 remaining = u16x16() + chunk;
+		uint32_t active = l.runMask & ~waitingAll;
+		uint32_t group = 0;
+		s16x16 m16 = s16x16();
+		while (active != 0)
+		{
+			// Lanes usually move together, so try the first active lane's pc
+			// before looking for the lane furthest behind.
+			unsigned lead = __builtin_ctz(active);
+			uint32_t next = lane_bits(l.pc == l.pc[lead]) & active;
+			if (next != active)
+			{
+				for (uint32_t rest = active; rest != 0; rest &= rest - 1)
+				{
+					unsigned lane = __builtin_ctz(rest);
+					if (remaining[lane] > remaining[lead])
+						lead = lane;
+				}
+				next = lane_bits(l.pc == l.pc[lead]) & active;
+			}
+
+			uint16_t at = l.pc[lead];
+			uint16_t opcode = l.fetchOpcode(lead, at);
+			if (l.diverged[at & 0xFFF] | l.diverged[(at + 1) & 0xFFF])
+				for (uint32_t rest = next; rest != 0; rest &= rest - 1)
+				{
+					unsigned lane = __builtin_ctz(rest);
+					if (l.fetchOpcode(lane, at) != opcode)
+						next &= ~(1u << lane);
+				}
+
+			chip8_insn &insn = l.decoded[at & 0xFFF];
+			if (insn.op == CHIP8_OP_UNDECODED || l.decodedOpcode[at & 0xFFF] != opcode)
+			{
+				chip8::decodeOpcode(opcode, insn);
+				l.decodedOpcode[at & 0xFFF] = opcode;
+			}
+
+			if (next != group)
+			{
+				group = next;
+				m16 = (u16x16)(laneBit & (uint16_t)group) != 0;
+			}
+			uint32_t waiting = step(l, insn, group, m16);
+			++l.stepCount;
+			l.insnCount += __builtin_popcount(group);
+
+			// RETIRE: a lane that did not move has hit an infinite loop and
+			// stops, except the ones left waiting for a key.
+			l.runMask &= ~(lane_bits(l.pc == at) & group & ~waiting);
+			waitingAll |= waiting;
+
+			remaining -= (u16x16)m16 & 1;
+			active &= ~lane_bits(remaining == 0);
+			active &= l.runMask & ~waitingAll;
+		}
+		for (unsigned lane = 0; lane < chip8lanes::LANES; ++lane)
+			l.retiredCount[lane] += chunk - remaining[lane];	// steps the lane took part in
+	}
+}
+
+void chip8lanes::draw(unsigned lane, const chip8_insn &insn)
+{
+	uint8_t xpixel = V[insn.x][lane] & (SCREEN_X - 1);
+	uint8_t ypixel = V[insn.y][lane] & (SCREEN_Y - 1);
+	uint16_t index = I[lane];
+	uint8_t collision = 0;
+	for (unsigned ypos = 0; ypos < insn.n; ++ypos)
+	{
+		uint64_t sprite = (uint64_t)memory[lane][(index + ypos) & 0xFFF] << 56;
+		if (xpixel != 0)
+			sprite = (sprite >> xpixel) | (sprite << (64 - xpixel));
+		uint64_t &row = gfx[lane][(ypixel + ypos) & (SCREEN_Y - 1)];
+		if (row & sprite)
+			collision = 1;
+		row ^= sprite;
+	}
+	V[0xF][lane] = collision;
+}
+
+// Applies insn to the lanes in group, which all sit at the same pc; m16 is
+// group as a vector mask. Returns the lanes left waiting on FX0A, their burst
+// is over. Semantics follow chip8::execute statement by statement, including
+// the order VF and VX are written in.
+uint32_t lanes_kernel::step(chip8lanes &l, const chip8_insn &insn, uint32_t group, const s16x16 &m16)
+{
+	const u8x16 mask8 = (u8x16)__builtin_convertvector(m16, s8x16);
+	const u16x16 mask16 = (u16x16)m16;
+	u8x16 (&V)[16] = l.V;
+	u16x16 &pc = l.pc;
+	u16x16 &I = l.I;
+	u8x16 &vx = V[insn.x];
+	u8x16 &vy = V[insn.y];
+	u8x16 &vf = V[0xF];
+	uint32_t waiting = 0;
+
+#define SET8(dst, value)	((dst) = ((value) & mask8) | ((dst) & ~mask8))
+#define SET16(dst, value)	((dst) = ((value) & mask16) | ((dst) & ~mask16))
+#define SKIP_IF(cond)		(pc += (2 + ((u16x16)__builtin_convertvector((s8x16)(cond), s16x16) & 2)) & mask16)
+#define EACH_LANE(lane) \
+	for (uint32_t rest_ = group, lane; rest_ != 0 && (lane = __builtin_ctz(rest_), true); rest_ &= rest_ - 1)
+
+	switch (insn.op)
+	{
+	case CHIP8_OP_CLS:
+		EACH_LANE(lane)
+			memset(l.gfx[lane], 0, sizeof(l.gfx[lane]));
+		pc += 2 & mask16;
+		break;
+	case CHIP8_OP_RET:
+		EACH_LANE(lane)
+		{
+			if (l.sp[lane] == 0)
+			{
+				l.runMask &= ~(1u << lane);
+				continue;
+			}
+			--l.sp[lane];
+			pc[lane] = l.stack[lane][l.sp[lane]] + 2;
+		}
+		break;
+	case CHIP8_OP_JP:
+		SET16(pc, u16x16() + insn.nnn);
+		break;
+	case CHIP8_OP_CALL:
+		EACH_LANE(lane)
+		{
+			l.stack[lane][l.sp[lane] & 0xF] = pc[lane];
+			if (++l.sp[lane] > 15)
+				l.runMask &= ~(1u << lane);
+			pc[lane] = insn.nnn;
+		}
+		break;
+	case CHIP8_OP_SE_BYTE: SKIP_IF(vx == insn.nn); break;
+	case CHIP8_OP_SNE_BYTE: SKIP_IF(vx != insn.nn); break;
+	case CHIP8_OP_SE_REG: SKIP_IF(vx == vy); break;
+	case CHIP8_OP_SNE_REG: SKIP_IF(vx != vy); break;
+	case CHIP8_OP_LD_BYTE: SET8(vx, u8x16() + insn.nn); pc += 2 & mask16; break;
+	case CHIP8_OP_ADD_BYTE: SET8(vx, vx + insn.nn); pc += 2 & mask16; break;
+	case CHIP8_OP_LD_REG: SET8(vx, vy); pc += 2 & mask16; break;
+	case CHIP8_OP_OR: SET8(vx, vx | vy); pc += 2 & mask16; break;
+	case CHIP8_OP_AND: SET8(vx, vx & vy); pc += 2 & mask16; break;
+	case CHIP8_OP_XOR: SET8(vx, vx ^ vy); pc += 2 & mask16; break;
+	case CHIP8_OP_ADD_REG:
+		SET8(vf, (u8x16)(vy > 0xFF - vx) & 1);
+		SET8(vx, vx + vy);
+		pc += 2 & mask16;
+		break;
+	case CHIP8_OP_SUB:
+		SET8(vf, (u8x16)(vy <= vx) & 1);
+		SET8(vx, vx - vy);
+		pc += 2 & mask16;
+		break;
+	case CHIP8_OP_SHR:
+		SET8(vf, vx & 1);
+		SET8(vx, vx >> 1);
+		pc += 2 & mask16;
+		break;
+	case CHIP8_OP_SUBN:
+		SET8(vf, (u8x16)(vx <= vy) & 1);
+		SET8(vx, vy - vx);
+		pc += 2 & mask16;
+		break;
+	case CHIP8_OP_SHL:
+		SET8(vf, vx >> 7);
+		SET8(vx, vx << 1);
+		pc += 2 & mask16;
+		break;
+	case CHIP8_OP_LD_I: SET16(I, u16x16() + insn.nnn); pc += 2 & mask16; break;
+	case CHIP8_OP_JP_V0:
+		SET16(pc, (__builtin_convertvector(V[0], u16x16) + insn.nnn) & 0x0FFF);
+		break;
+	case CHIP8_OP_RND:
+	{
+		// chip8_rng_next on every lane, only the masked ones keep the result
+		u32x16 &rng = l.rng;
+		u32x16 next = rng ^ (rng << 13);
+		next ^= next >> 17;
+		next ^= next << 5;
+		const u32x16 mask32 = (u32x16)__builtin_convertvector(m16, s32x16);
+		rng = (next & mask32) | (rng & ~mask32);
+		SET8(vx, __builtin_convertvector(next >> 24, u8x16) & insn.nn);
+		pc += 2 & mask16;
+		break;
+	}
+	case CHIP8_OP_DRW:
+		EACH_LANE(lane)
+			l.draw(lane, insn);
+		pc += 2 & mask16;
+		break;
+	case CHIP8_OP_SKP:
+	case CHIP8_OP_SKNP:
+	{
+		u16x16 key = __builtin_convertvector(vx, u16x16);
+		s16x16 down = ((l.keys16 >> (key & 0xF)) & 1) != 0;
+		down &= (s16x16)(key < 16);
+		if (insn.op == CHIP8_OP_SKNP)
+			down = ~down;
+		pc += (2 + ((u16x16)down & 2)) & mask16;
+		break;
+	}
+	case CHIP8_OP_LD_VX_DT: SET8(vx, l.delay_timer); pc += 2 & mask16; break;
+	case CHIP8_OP_LD_VX_K:
+		EACH_LANE(lane)
+		{
+			if (l.keys16[lane] == 0)
+			{
+				waiting |= 1u << lane;
+				continue;
+			}
+			vx[lane] = 31 - __builtin_clz(l.keys16[lane]);	// chip8 keeps the highest key down
+			pc[lane] += 2;
+		}
+		break;
+	case CHIP8_OP_LD_DT_VX: SET8(l.delay_timer, vx); pc += 2 & mask16; break;
+	case CHIP8_OP_LD_ST_VX: SET8(l.sound_timer, vx); pc += 2 & mask16; break;
+	case CHIP8_OP_ADD_I:
+		SET8(vf, (u8x16)__builtin_convertvector(I > 0xFFF - __builtin_convertvector(vx, u16x16), s8x16) & 1);
+		SET16(I, I + __builtin_convertvector(vx, u16x16));
+		pc += 2 & mask16;
+		break;
+	case CHIP8_OP_LD_F: SET16(I, __builtin_convertvector(vx, u16x16) * 5); pc += 2 & mask16; break;
+	case CHIP8_OP_LD_B:
+		EACH_LANE(lane)
+		{
+			uint16_t index = I[lane];
+			uint8_t value = vx[lane];
+			l.memory[lane][index & 0xFFF] = value / 100;
+			l.memory[lane][(index + 1) & 0xFFF] = (value % 100) / 10;
+			l.memory[lane][(index + 2) & 0xFFF] = value % 10;
+			for (unsigned i = 0; i < 3; ++i)
+				l.diverged[(index + i) & 0xFFF] = 1;
+			pc[lane] += 2;
+		}
+		break;
+	case CHIP8_OP_LD_MEM_VX:
+		EACH_LANE(lane)
+		{
+			uint16_t index = I[lane];
+			for (unsigned i = 0; i <= insn.x; ++i)
+			{
+				l.memory[lane][(index + i) & 0xFFF] = V[i][lane];
+				l.diverged[(index + i) & 0xFFF] = 1;
+			}
+			I[lane] = index + insn.x + 1;
+			pc[lane] += 2;
+		}
+		break;
+	case CHIP8_OP_LD_VX_MEM:
+		EACH_LANE(lane)
+		{
+			uint16_t index = I[lane];
+			for (unsigned i = 0; i <= insn.x; ++i)
+				V[i][lane] = l.memory[lane][(index + i) & 0xFFF];
+			I[lane] = index + insn.x + 1;
+			pc[lane] += 2;
+		}
+		break;
+	default:	// CHIP8_OP_SCHIP, CHIP8_OP_UNKNOWN
+		l.runMask &= ~group;
+		break;
+	}
+
+#undef SET8
+#undef SET16
+#undef SKIP_IF
+#undef EACH_LANE
+	return waiting;
+}
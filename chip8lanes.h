@@ -0,0 +1,79 @@
+#ifndef CHIP8LANES_H
+#define CHIP8LANES_H
+
+#include "chip8.h"
+
+// Structure-of-arrays interpreter for LANES machines running the same ROM.
+// Registers, I, pc and the timers are held one vector per field with a lane
+// per machine. Every step picks a pc, decodes the opcode there once and applies
+// it to all lanes sitting at that pc under a lane mask; lanes elsewhere wait
+// and are caught up by later steps, the one furthest behind going first. ALU,
+// skip, jump, timer and key instructions are plain vector operations. Calls,
+// draws and memory transfers loop over the masked lanes.
+//
+// Lanes are loaded from and stored back to chip8 through savestates, and a
+// lane's runFrame gives the same state as chip8::runFrame on the machine it
+// was loaded from. The exception is EX9E/EXA1 with VX above 15, where chip8
+// reads past its keypad: here such keys are never pressed.
+class chip8lanes
+{
+public:
+	enum { LANES = 16 };
+
+	chip8lanes();
+
+	bool load(unsigned lane, const chip8 &emu);
+	bool store(unsigned lane, chip8 &emu) const;
+
+	void setKeys(unsigned lane, uint16_t keys) { keys16[lane] = keys; }	// bit k set when key k is down
+	void runFrame(unsigned ipf);		// every lane: ipf instructions with the timers held, then one 60 Hz timer tick
+
+	bool running(unsigned lane) const { return (runMask >> lane) & 1; }
+	const uint64_t *display(unsigned lane) const { return gfx[lane]; }
+
+	uint64_t steps() const { return stepCount; }			// opcodes dispatched
+	uint64_t instructions() const { return insnCount; }		// lane instructions retired, steps() times the average lanes per step
+	uint64_t retired(unsigned lane) const { return retiredCount[lane]; }	// the lane's share of instructions() since its load
+
+private:
+	friend struct lanes_kernel;
+
+	typedef uint8_t u8x16 __attribute__((vector_size(16)));
+	typedef int8_t s8x16 __attribute__((vector_size(16)));
+	typedef uint16_t u16x16 __attribute__((vector_size(32)));
+	typedef int16_t s16x16 __attribute__((vector_size(32)));
+	typedef uint32_t u32x16 __attribute__((vector_size(64)));
+	typedef int32_t s32x16 __attribute__((vector_size(64)));
+
+	uint16_t fetchOpcode(unsigned lane, uint16_t addr) const;
+	void draw(unsigned lane, const chip8_insn &insn);
+
+	u8x16 V[16];			// V[r][lane]
+	u16x16 I;
+	u16x16 pc;
+	u16x16 keys16;
+	u8x16 sp;
+	u8x16 delay_timer;
+	u8x16 sound_timer;
+	u32x16 rng;				// chip8_rng_next state per lane
+	uint32_t runMask;		// lanes still running, bit per lane
+
+	uint16_t stack[LANES][16];
+	uint8_t memory[LANES][0x1000];
+	uint64_t gfx[LANES][SCREEN_Y];
+
+	// Addresses where some lane's memory may differ from image, the memory of
+	// the first lane loaded: set by loads that differ there and by FX33/FX55.
+	// Lanes only need their opcodes compared one by one where this is set.
+	uint8_t image[0x1000];
+	uint8_t diverged[0x1000];
+	bool haveImage;
+	chip8_insn decoded[0x1000];
+	uint16_t decodedOpcode[0x1000];	// opcode decoded[addr] was built from
+
+	uint64_t stepCount;
+	uint64_t insnCount;
+	uint64_t retiredCount[LANES];
+};
+
+#endif
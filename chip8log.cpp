@@ -0,0 +1,238 @@
+#include "chip8log.h"
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef CHIP8_ASYNC_LOG
+#include <chrono>
+#include <thread>
+#endif
+
+enum
+{
+	ARG_INT,
+	ARG_LONG,
+	ARG_LLONG,
+	ARG_SIZE,
+	ARG_INTMAX,
+	ARG_PTRDIFF,
+	ARG_OTHER	// not an integer conversion, the record is formatted at push time
+};
+
+static const size_t SPEC_SIZE = 16;
+
+// p points at the '%' of a conversion other than "%%". Returns the end of the
+// conversion and sets type to how its argument was passed.
+static const char *parse_conversion(const char *p, int &type)
+{
+	const char *q = p + 1;
+	q += strspn(q, "-+ #0");
+	q += strspn(q, "0123456789");
+	if (*q == '.')
+	{
+		++q;
+		q += strspn(q, "0123456789");
+	}
+
+	type = ARG_INT;
+	switch (*q)
+	{
+	case 'h': q += q[1] == 'h' ? 2 : 1; break;
+	case 'l': if (q[1] == 'l') { type = ARG_LLONG; q += 2; } else { type = ARG_LONG; ++q; } break;
+	case 'z': type = ARG_SIZE; ++q; break;
+	case 'j': type = ARG_INTMAX; ++q; break;
+	case 't': type = ARG_PTRDIFF; ++q; break;
+	}
+
+	if (*q == '\0' || strchr("diuxXoc", *q) == NULL)
+	{
+		type = ARG_OTHER;
+		return q;
+	}
+	return q + 1;
+}
+
+static void format_record(char *out, size_t size, const char *fmt, const unsigned long long *args)
+{
+	char spec[SPEC_SIZE];
+	size_t n = 0;
+	unsigned i = 0;
+	const char *p = fmt;
+	while (*p != '\0' && n + 1 < size)
+	{
+		if (p[0] != '%')
+		{
+			out[n++] = *p++;
+			continue;
+		}
+		if (p[1] == '%')
+		{
+			out[n++] = '%';
+			p += 2;
+			continue;
+		}
+
+		int type;
+		const char *end = parse_conversion(p, type);
+		memcpy(spec, p, end - p);
+		spec[end - p] = '\0';
+		unsigned long long v = args[i++];
+		int written = 0;
+		switch (type)
+		{
+		case ARG_INT: written = snprintf(out + n, size - n, spec, (int)v); break;
+		case ARG_LONG: written = snprintf(out + n, size - n, spec, (long)v); break;
+		case ARG_LLONG: written = snprintf(out + n, size - n, spec, (long long)v); break;
+		case ARG_SIZE: written = snprintf(out + n, size - n, spec, (size_t)v); break;
+		case ARG_INTMAX: written = snprintf(out + n, size - n, spec, (intmax_t)v); break;
+		case ARG_PTRDIFF: written = snprintf(out + n, size - n, spec, (ptrdiff_t)v); break;
+		}
+		if (written > 0)
+			n += (size_t)written < size - n ? (size_t)written : size - n - 1;
+		p = end;
+	}
+	out[n] = '\0';
+}
+
+chip8logring::chip8logring()
+	: head(0), tail(0), lost(0), reported(0)
+#ifdef CHIP8_ASYNC_LOG
+	, thread(NULL)
+#endif
+{
+}
+
+chip8logring::~chip8logring()
+{
+#ifdef CHIP8_ASYNC_LOG
+	stop();
+#endif
+}
+
+bool chip8logring::push(int level, const char *fmt, ...)
+{
+	uint32_t h = head.load(std::memory_order_relaxed);
+	if (h - tail.load(std::memory_order_acquire) == CAPACITY)
+	{
+		lost.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	record &r = records[h & (CAPACITY - 1)];
+	r.level = level;
+	r.fmt = fmt;
+	r.nargs = 0;
+
+	va_list va;
+	va_start(va, fmt);
+	for (const char *p = fmt; (p = strchr(p, '%')) != NULL; )
+	{
+		if (p[1] == '%')
+		{
+			p += 2;
+			continue;
+		}
+		int type;
+		const char *end = parse_conversion(p, type);
+		if (type == ARG_OTHER || r.nargs == MAX_ARGS || (size_t)(end - p) >= SPEC_SIZE)
+		{
+			r.fmt = NULL;
+			break;
+		}
+		switch (type)
+		{
+		case ARG_INT: r.args[r.nargs++] = va_arg(va, int); break;
+		case ARG_LONG: r.args[r.nargs++] = va_arg(va, long); break;
+		case ARG_LLONG: r.args[r.nargs++] = va_arg(va, long long); break;
+		case ARG_SIZE: r.args[r.nargs++] = va_arg(va, size_t); break;
+		case ARG_INTMAX: r.args[r.nargs++] = va_arg(va, intmax_t); break;
+		case ARG_PTRDIFF: r.args[r.nargs++] = va_arg(va, ptrdiff_t); break;
+		}
+		p = end;
+	}
+	va_end(va);
+
+	if (r.fmt == NULL)
+	{
+		va_start(va, fmt);
+		vsnprintf(r.text, sizeof(r.text), fmt, va);
+		va_end(va);
+	}
+
+	head.store(h + 1, std::memory_order_release);
+	return true;
+}
+
+unsigned chip8logring::drain(chip8_log_cb sink)
+{
+	char text[256];
+	unsigned n = 0;
+	uint32_t t = tail.load(std::memory_order_relaxed);
+	while (t != head.load(std::memory_order_acquire))
+	{
+		const record &r = records[t & (CAPACITY - 1)];
+		if (r.fmt != NULL)
+		{
+			format_record(text, sizeof(text), r.fmt, r.args);
+			sink(r.level, "%s", text);
+		}
+		else
+		{
+			sink(r.level, "%s", r.text);
+		}
+		tail.store(++t, std::memory_order_release);
+		++n;
+	}
+
+	uint32_t dropped = lost.load(std::memory_order_relaxed);
+	if (dropped != reported)
+	{
+		sink(CHIP8_LOG_WARN, "%u log records dropped\n", (unsigned)(dropped - reported));
+		reported = dropped;
+	}
+	return n;
+}
+
+#ifdef CHIP8_ASYNC_LOG
+struct chip8logring::worker
+{
+	std::thread thread;
+	std::atomic<bool> stopping;
+};
+
+bool chip8logring::start(chip8_log_cb sink)
+{
+	if (thread != NULL)
+		return true;
+
+	thread = new worker;
+	thread->stopping = false;
+	try
+	{
+		thread->thread = std::thread([this, sink]()
+		{
+			while (!thread->stopping.load(std::memory_order_acquire))
+				if (drain(sink) == 0)
+					std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			drain(sink);
+		});
+	}
+	catch (...)
+	{
+		delete thread;
+		thread = NULL;
+		return false;
+	}
+	return true;
+}
+
+void chip8logring::stop()
+{
+	if (thread == NULL)
+		return;
+	thread->stopping.store(true, std::memory_order_release);
+	thread->thread.join();
+	delete thread;
+	thread = NULL;
+}
+#endif
@@ -0,0 +1,58 @@
+#ifndef CHIP8LOG_H
+#define CHIP8LOG_H
+
+#include <atomic>
+#include "chip8.h"
+
+// Deferred logging. The emulation thread pushes the format string and its
+// integer arguments into a fixed single-producer single-consumer ring without
+// formatting anything; drain() formats the records and hands them to a sink on
+// whichever thread calls it. With CHIP8_ASYNC_LOG, start() runs a background
+// thread that drains the ring until stop().
+//
+// Formats must outlive the record (string literals do). Conversions other than
+// integer ones (%d %i %u %x %X %o %c with h/l/ll/z/j/t modifiers) are formatted
+// at push time instead. When the ring is full records are dropped and counted;
+// drain() reports the count dropped since its last report as a warning.
+class chip8logring
+{
+public:
+	chip8logring();
+	~chip8logring();
+
+	bool push(int level, const char *fmt, ...);
+	unsigned drain(chip8_log_cb sink);		// records handed to sink
+	uint32_t dropped() const { return lost.load(std::memory_order_relaxed); }
+
+#ifdef CHIP8_ASYNC_LOG
+	bool start(chip8_log_cb sink);
+	void stop();
+#endif
+
+private:
+	enum { CAPACITY = 256 };	// power of two
+	enum { MAX_ARGS = 6 };
+	enum { TEXT_SIZE = 96 };
+
+	struct record
+	{
+		int level;
+		const char *fmt;		// NULL when text holds the message already formatted
+		unsigned nargs;
+		unsigned long long args[MAX_ARGS];
+		char text[TEXT_SIZE];
+	};
+
+	record records[CAPACITY];
+	std::atomic<uint32_t> head;		// next record to write, owned by the producer
+	std::atomic<uint32_t> tail;		// next record to read, owned by the consumer
+	std::atomic<uint32_t> lost;
+	uint32_t reported;				// lost as of the last report, owned by the consumer
+
+#ifdef CHIP8_ASYNC_LOG
+	struct worker;
+	worker *thread;
+#endif
+};
+
+#endif
@@ -0,0 +1,31 @@
+// ROM packer: indexes a directory of ROMs, or an existing archive, and writes
+// it out as one archive for chip8romlib to map. See chip8romlib.h for the layout.
+#include <stdio.h>
+
+#include "chip8romlib.h"
+
+int main(int argc, char **argv)
+{
+	if (argc != 3)
+	{
+		fprintf(stderr,
+			"usage: %s DIR|ARCHIVE OUT\n"
+			"  packs every ROM of DIR, or the entries of ARCHIVE, into OUT\n"
+			, argv[0]);
+		return 2;
+	}
+
+	static chip8romlib library;
+	if (!library.open(argv[1]))
+	{
+		fprintf(stderr, "%s: cannot open ROM library\n", argv[1]);
+		return 1;
+	}
+	if (!library.write(argv[2]))
+	{
+		fprintf(stderr, "%s: cannot write archive\n", argv[2]);
+		return 1;
+	}
+	printf("%s: %zu ROMs packed, %zu files skipped\n", argv[2], library.size(), library.skipped());
+	return 0;
+}
@@ -0,0 +1,151 @@
+#include "chip8perf.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+chip8perf::chip8perf()
+	: emulatedFrames(0), emulatedInsns(0), failure(NULL)
+{
+	for (unsigned c = 0; c < COUNTERS; ++c)
+		fds[c] = -1;
+	memset(begin, 0, sizeof(begin));
+	memset(totals, 0, sizeof(totals));
+}
+
+chip8perf::~chip8perf()
+{
+	close();
+}
+
+const char *chip8perf::name(counter c)
+{
+	static const char * const names[COUNTERS] = { "cycles", "instructions", "branch-misses", "L1d-misses" };
+	return c < COUNTERS ? names[c] : NULL;
+}
+
+unsigned chip8perf::open()
+{
+	close();
+	failure = NULL;
+	unsigned opened = 0;
+#ifdef __linux__
+	for (unsigned c = 0; c < COUNTERS; ++c)
+	{
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		switch (c)
+		{
+		case CYCLES: attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+		case INSTRUCTIONS: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+		case BRANCH_MISSES: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+		default:
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		}
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.exclude_kernel = 1;	// allowed at perf_event_paranoid 2
+		attr.exclude_hv = 1;
+		attr.inherit = 1;			// farm worker threads started later count too
+
+		int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (fd < 0)
+		{
+			failure = strerror(errno);
+			continue;
+		}
+		fds[c] = fd;
+		++opened;
+	}
+#else
+	failure = "perf_event_open is Linux only";
+#endif
+	reset();
+	return opened;
+}
+
+void chip8perf::close()
+{
+#ifdef __linux__
+	for (unsigned c = 0; c < COUNTERS; ++c)
+		if (fds[c] >= 0)
+			::close(fds[c]);
+#endif
+	for (unsigned c = 0; c < COUNTERS; ++c)
+		fds[c] = -1;
+}
+
+void chip8perf::reset()
+{
+	memset(totals, 0, sizeof(totals));
+	emulatedFrames = 0;
+	emulatedInsns = 0;
+}
+
+bool chip8perf::read(counter c, sample &s) const
+{
+#ifdef __linux__
+	return fds[c] >= 0 && ::read(fds[c], &s, sizeof(s)) == (ssize_t)sizeof(s);
+#else
+	(void)c;
+	(void)s;
+	return false;
+#endif
+}
+
+void chip8perf::start()
+{
+	for (unsigned c = 0; c < COUNTERS; ++c)
+		read((counter)c, begin[c]);
+}
+
+void chip8perf::stop()
+{
+	for (unsigned c = 0; c < COUNTERS; ++c)
+	{
+		sample end;
+		if (!read((counter)c, end))
+			continue;
+		uint64_t value = end.value - begin[c].value;
+		uint64_t enabled = end.enabled - begin[c].enabled;
+		uint64_t running = end.running - begin[c].running;
+		if (running > 0 && running < enabled)	// multiplexed, extrapolate to the whole interval
+			value = (uint64_t)((double)value * enabled / running);
+		totals[c] += value;
+	}
+}
+
+size_t chip8perf::format(char *buf, size_t size) const
+{
+	if (size == 0)
+		return 0;
+	size_t n = 0;
+	buf[0] = '\0';
+	double frames = (double)emulatedFrames;
+	double millions = emulatedInsns / 1e6;
+	for (unsigned c = 0; c < COUNTERS; ++c)
+	{
+		if (!available((counter)c) || n >= size)
+			continue;
+		int w = snprintf(buf + n, size - n, "%s%s %.4g/frame %.4g/Minsn", n > 0 ? ", " : "", name((counter)c),
+			frames > 0 ? totals[c] / frames : 0.0, millions > 0 ? totals[c] / millions : 0.0);
+		if (w > 0)
+			n += (size_t)w;
+	}
+	if (available(CYCLES) && available(INSTRUCTIONS) && totals[CYCLES] > 0 && n < size)
+	{
+		int w = snprintf(buf + n, size - n, ", ipc %.2f", (double)totals[INSTRUCTIONS] / totals[CYCLES]);
+		if (w > 0)
+			n += (size_t)w;
+	}
+	return n < size ? n : size - 1;
+}
@@ -0,0 +1,68 @@
+#ifndef CHIP8PERF_H
+#define CHIP8PERF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hardware counters around emulation, through Linux perf_event_open. Each
+// counter is opened on its own, so a host that lacks one (VMs often have no
+// PMU at all) still reports the rest; open() returning 0 means none work and
+// every other call is a cheap no-op. Counters follow the calling thread and
+// the threads it starts afterwards, and are scaled when the kernel had to
+// multiplex them.
+//
+// start()/stop() bracket the code being measured and may be repeated, the
+// emulated frames and instructions it ran are added with addWork().
+class chip8perf
+{
+public:
+	enum counter
+	{
+		CYCLES,
+		INSTRUCTIONS,
+		BRANCH_MISSES,
+		L1D_MISSES,		// L1 data cache read misses
+
+		COUNTERS
+	};
+
+	chip8perf();
+	~chip8perf();
+
+	unsigned open();		// counters opened
+	void close();
+	const char *error() const { return failure; }	// why the last counter that failed to open did, NULL if none did
+
+	void start();
+	void stop();
+	void addWork(uint64_t frames, uint64_t instructions) { emulatedFrames += frames; emulatedInsns += instructions; }
+	void reset();			// drops the totals, counters stay open
+
+	bool available(counter c) const { return fds[c] >= 0; }
+	uint64_t total(counter c) const { return totals[c]; }
+	uint64_t frames() const { return emulatedFrames; }
+	uint64_t instructions() const { return emulatedInsns; }
+	static const char *name(counter c);
+
+	// "cycles 1.23e+05/frame 1.2e+09/Minsn, ..." for the available counters.
+	size_t format(char *buf, size_t size) const;
+
+private:
+	struct sample
+	{
+		uint64_t value;
+		uint64_t enabled;
+		uint64_t running;
+	};
+
+	bool read(counter c, sample &s) const;
+
+	int fds[COUNTERS];
+	sample begin[COUNTERS];
+	uint64_t totals[COUNTERS];
+	uint64_t emulatedFrames;
+	uint64_t emulatedInsns;
+	const char *failure;
+};
+
+#endif
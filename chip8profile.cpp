@@ -0,0 +1,114 @@
+#include "chip8profile.h"
+#include "chip8.h"
+
+#include <algorithm>
+#include <vector>
+
+static_assert(CHIP8_PROFILE_OPS == CHIP8_OP_COUNT, "chip8_profile out of sync with CHIP8_OP");
+
+static const char * const op_names[CHIP8_OP_COUNT] = // in CHIP8_OP order
+{
+	"UNDECODED",
+	"CLS", "RET", "SCHIP",
+	"JP", "CALL",
+	"SE_BYTE", "SNE_BYTE", "SE_REG",
+	"LD_BYTE", "ADD_BYTE",
+	"LD_REG", "OR", "AND", "XOR",
+	"ADD_REG", "SUB", "SHR", "SUBN", "SHL",
+	"SNE_REG", "LD_I", "JP_V0", "RND", "DRW",
+	"SKP", "SKNP",
+	"LD_VX_DT", "LD_VX_K", "LD_DT_VX", "LD_ST_VX",
+	"ADD_I", "LD_F", "LD_B",
+	"LD_MEM_VX", "LD_VX_MEM",
+	"UNKNOWN",
+};
+
+void chip8_profile_clear(struct chip8_profile *profile)
+{
+	memset(profile, 0, sizeof(*profile));
+}
+
+uint64_t chip8_profile_instructions(const struct chip8_profile *profile)
+{
+	uint64_t total = 0;
+	for (unsigned op = 0; op < CHIP8_OP_COUNT; ++op)
+		total += profile->ops[op];
+	return total;
+}
+
+const char *chip8_profile_op_name(unsigned op)
+{
+	return op < CHIP8_OP_COUNT ? op_names[op] : NULL;
+}
+
+// Enough escaping for file names: quotes and backslashes, control characters dropped.
+static void write_json_string(const char *s, FILE *out)
+{
+	fputc('"', out);
+	for (; *s != '\0'; ++s)
+	{
+		if (*s == '"' || *s == '\\')
+			fputc('\\', out);
+		if ((unsigned char)*s >= 0x20)
+			fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+int chip8_profile_write_json(const struct chip8_profile *profile, const char *name, unsigned top, FILE *out)
+{
+	fputs("{\"rom\":", out);
+	write_json_string(name != NULL ? name : "", out);
+	fprintf(out, ",\"instructions\":%llu,\"draw_rows\":%llu,\"idle_skipped\":%llu,\"ops\":{",
+		(unsigned long long)chip8_profile_instructions(profile), (unsigned long long)profile->drawRows,
+		(unsigned long long)profile->idleSkipped);
+	bool first = true;
+	for (unsigned op = 0; op < CHIP8_OP_COUNT; ++op)
+	{
+		if (profile->ops[op] == 0)
+			continue;
+		fprintf(out, "%s\"%s\":%llu", first ? "" : ",", op_names[op], (unsigned long long)profile->ops[op]);
+		first = false;
+	}
+
+	std::vector<uint16_t> hot;
+	for (uint16_t pc = 0; pc < 0x1000; ++pc)
+		if (profile->pcHits[pc] != 0)
+			hot.push_back(pc);
+	auto hotter = [profile](uint16_t a, uint16_t b)
+	{
+		return profile->pcHits[a] > profile->pcHits[b] || (profile->pcHits[a] == profile->pcHits[b] && a < b);
+	};
+	if (top < hot.size())
+	{
+		std::partial_sort(hot.begin(), hot.begin() + top, hot.end(), hotter);
+		hot.resize(top);
+	}
+	else
+		std::sort(hot.begin(), hot.end(), hotter);
+
+	fputs("},\"hot_pcs\":[", out);
+	for (size_t i = 0; i < hot.size(); ++i)
+		fprintf(out, "%s{\"pc\":\"0x%03X\",\"hits\":%llu}", i == 0 ? "" : ",", hot[i],
+			(unsigned long long)profile->pcHits[hot[i]]);
+	fputs("]}", out);
+	return ferror(out) ? -1 : 0;
+}
+
+int chip8_profile_write_csv(const struct chip8_profile *profile, const char *name, int header, FILE *out)
+{
+	if (name == NULL)
+		name = "";
+	if (header)
+		fputs("rom,kind,key,count\n", out);
+	for (unsigned op = 0; op < CHIP8_OP_COUNT; ++op)
+		if (profile->ops[op] != 0)
+			fprintf(out, "%s,op,%s,%llu\n", name, op_names[op], (unsigned long long)profile->ops[op]);
+	for (unsigned pc = 0; pc < 0x1000; ++pc)
+		if (profile->pcHits[pc] != 0)
+			fprintf(out, "%s,pc,0x%03X,%llu\n", name, pc, (unsigned long long)profile->pcHits[pc]);
+	fprintf(out, "%s,total,instructions,%llu\n", name, (unsigned long long)chip8_profile_instructions(profile));
+	fprintf(out, "%s,total,draw_rows,%llu\n", name, (unsigned long long)profile->drawRows);
+	fprintf(out, "%s,total,idle_skipped,%llu\n", name, (unsigned long long)profile->idleSkipped);
+	return ferror(out) ? -1 : 0;
+}
@@ -0,0 +1,39 @@
+#ifndef CHIP8PROFILE_H
+#define CHIP8PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Execution counters. A chip8 built with CHIP8_PROFILE fills the profile
+// attached with chip8::setProfile; without it the hooks are compiled out and
+// nothing is counted. Only the interpreter counts: blocks run by chip8jit and
+// machines run on chip8lanes are not seen. Plain C so that tools can read it.
+
+#define CHIP8_PROFILE_OPS 37	// CHIP8_OP_COUNT
+
+struct chip8_profile
+{
+	uint64_t ops[CHIP8_PROFILE_OPS];	// instructions retired per CHIP8_OP
+	uint64_t pcHits[0x1000];			// instructions retired per address
+	uint64_t drawRows;					// sprite rows DXYN drew
+	uint64_t idleSkipped;				// instructions not run because an idle loop or FX0A was fast-forwarded
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void chip8_profile_clear(struct chip8_profile *profile);
+uint64_t chip8_profile_instructions(const struct chip8_profile *profile);	// sum of ops
+const char *chip8_profile_op_name(unsigned op);		// "JP", "DRW", ... NULL past the last op
+
+// One JSON object per call: totals, every op and the hottest top addresses.
+int chip8_profile_write_json(const struct chip8_profile *profile, const char *name, unsigned top, FILE *out);
+// rom,kind,key,count rows: one per op, one per address that was hit, then the totals.
+int chip8_profile_write_csv(const struct chip8_profile *profile, const char *name, int header, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,217 @@
+#include "chip8rewind.h"
+
+// Each ring entry is [uint32 size][size bytes of delta][uint32 size] so it can
+// be walked in both directions. A delta is a sequence of
+// (varint equal bytes to skip, varint byte count, XORed bytes) tokens.
+
+static size_t put_varint(uint8_t *out, size_t value)
+{
+	size_t n = 0;
+	while (value >= 0x80)
+	{
+		out[n++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	out[n++] = (uint8_t)value;
+	return n;
+}
+
+static size_t get_varint(const uint8_t *in, size_t &pos)
+{
+	size_t value = 0;
+	for (unsigned shift = 0; ; shift += 7)
+	{
+		uint8_t byte = in[pos++];
+		value |= (size_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			return value;
+	}
+}
+
+static uint64_t load64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+chip8rewind::chip8rewind()
+	: ring(NULL), capacity(0)
+{
+	clear();
+}
+
+chip8rewind::~chip8rewind()
+{
+	deinit();
+}
+
+bool chip8rewind::init(size_t capacity_)
+{
+	deinit();
+	ring = static_cast<uint8_t*>(malloc(capacity_));
+	if (ring == NULL)
+		return false;
+	capacity = capacity_;
+	clear();
+	return true;
+}
+
+void chip8rewind::deinit()
+{
+	free(ring);
+	ring = NULL;
+	capacity = 0;
+	clear();
+}
+
+void chip8rewind::clear()
+{
+	head = tail = used = cursor = 0;
+	count = first = last = pos = 0;
+}
+
+size_t chip8rewind::encode(const uint8_t *a, const uint8_t *b, uint8_t *out) const
+{
+	size_t n = 0;
+	size_t i = 0;
+	while (i < STATE_SIZE)
+	{
+		size_t start = i;
+		while (i + 8 <= STATE_SIZE && load64(a + i) == load64(b + i))
+			i += 8;
+		while (i < STATE_SIZE && a[i] == b[i])
+			++i;
+		if (i == STATE_SIZE)
+			break;
+
+		// A literal run ends at two equal bytes in a row, a single one is cheaper to carry along.
+		size_t literal = i;
+		while (i < STATE_SIZE && !(a[i] == b[i] && (i + 1 == STATE_SIZE || a[i + 1] == b[i + 1])))
+			++i;
+
+		n += put_varint(out + n, literal - start);
+		n += put_varint(out + n, i - literal);
+		for (size_t j = literal; j < i; ++j)
+			out[n++] = a[j] ^ b[j];
+	}
+	return n;
+}
+
+void chip8rewind::apply(const uint8_t *delta_, size_t size, uint8_t *state_) const
+{
+	size_t p = 0;
+	size_t i = 0;
+	while (p < size)
+	{
+		i += get_varint(delta_, p);
+		size_t literal = get_varint(delta_, p);
+		for (size_t j = 0; j < literal; ++j)
+			state_[i++] ^= delta_[p++];
+	}
+}
+
+void chip8rewind::ringWrite(size_t offset, const void *data, size_t size)
+{
+	size_t part = capacity - offset < size ? capacity - offset : size;
+	memcpy(ring + offset, data, part);
+	memcpy(ring, static_cast<const uint8_t*>(data) + part, size - part);
+}
+
+void chip8rewind::ringRead(size_t offset, void *data, size_t size) const
+{
+	size_t part = capacity - offset < size ? capacity - offset : size;
+	memcpy(data, ring + offset, part);
+	memcpy(static_cast<uint8_t*>(data) + part, ring, size - part);
+}
+
+uint32_t chip8rewind::readSize(size_t offset) const
+{
+	uint32_t size;
+	ringRead(offset % capacity, &size, sizeof(size));
+	return size;
+}
+
+void chip8rewind::dropOldest()
+{
+	size_t entry = readSize(tail) + 2 * sizeof(uint32_t);
+	tail = (tail + entry) % capacity;
+	used -= entry;
+	++first;
+	--count;
+}
+
+void chip8rewind::dropNewest()
+{
+	size_t entry = readSize(head + capacity - sizeof(uint32_t)) + 2 * sizeof(uint32_t);
+	head = (head + capacity - entry) % capacity;
+	used -= entry;
+	--last;
+	--count;
+}
+
+bool chip8rewind::push(const chip8 &emu)
+{
+	if (ring == NULL || !emu.serialize(scratch, STATE_SIZE))
+		return false;
+
+	if (count == 0)
+	{
+		memcpy(state, scratch, STATE_SIZE);
+		count = 1;
+		first = last = pos;
+		return true;
+	}
+
+	while (last > pos)
+		dropNewest();
+
+	uint32_t size = encode(state, scratch, delta);
+	size_t entry = size + 2 * sizeof(uint32_t);
+	if (entry > capacity)
+		return false;
+	while (capacity - used < entry)
+		dropOldest();
+
+	ringWrite(head, &size, sizeof(size));
+	ringWrite((head + sizeof(size)) % capacity, delta, size);
+	ringWrite((head + sizeof(size) + size) % capacity, &size, sizeof(size));
+	head = (head + entry) % capacity;
+	used += entry;
+
+	memcpy(state, scratch, STATE_SIZE);
+	cursor = head;
+	pos = ++last;
+	++count;
+	return true;
+}
+
+bool chip8rewind::seek(chip8 &emu, uint32_t frame)
+{
+	if (count == 0 || frame < first || frame > last)
+		return false;
+
+	while (pos > frame)
+	{
+		uint32_t size = readSize(cursor + capacity - sizeof(uint32_t));
+		cursor = (cursor + capacity - size - 2 * sizeof(uint32_t)) % capacity;
+		ringRead((cursor + sizeof(uint32_t)) % capacity, delta, size);
+		apply(delta, size, state);
+		--pos;
+	}
+	while (pos < frame)
+	{
+		uint32_t size = readSize(cursor);
+		ringRead((cursor + sizeof(uint32_t)) % capacity, delta, size);
+		apply(delta, size, state);
+		cursor = (cursor + size + 2 * sizeof(uint32_t)) % capacity;
+		++pos;
+	}
+
+	return emu.unserialize(state, STATE_SIZE);
+}
+
+bool chip8rewind::stepBack(chip8 &emu)
+{
+	return count > 0 && pos > first && seek(emu, pos - 1);
+}
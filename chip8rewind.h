@@ -0,0 +1,62 @@
+#ifndef CHIP8REWIND_H
+#define CHIP8REWIND_H
+
+#include "chip8.h"
+
+// Rewind history. One savestate per frame is kept as the XOR against the
+// previous frame, run-length encoded, in a fixed-size byte ring allocated once
+// by init(). The state at the current position is kept decoded so stepping one
+// frame either way only decodes a single delta. When the ring is full the
+// oldest frames are dropped.
+class chip8rewind
+{
+public:
+	chip8rewind();
+	~chip8rewind();
+
+	bool init(size_t capacity);
+	void deinit();
+	void clear();
+
+	bool push(const chip8 &emu);				// record emu as the frame after the current one, dropping any frames past it
+	bool seek(chip8 &emu, uint32_t frame);		// load a recorded frame into emu
+	bool stepBack(chip8 &emu);
+
+	bool initialized() const { return ring != NULL; }
+	bool empty() const { return count == 0; }
+	uint32_t oldestFrame() const { return first; }
+	uint32_t newestFrame() const { return last; }
+	uint32_t currentFrame() const { return pos; }
+	size_t bytesUsed() const { return used; }
+
+private:
+	enum { STATE_SIZE = sizeof(chip8_savestate) };
+	enum { MAX_DELTA = STATE_SIZE * 2 };	// generous bound on the encoded size
+
+	size_t encode(const uint8_t *a, const uint8_t *b, uint8_t *out) const;
+	void apply(const uint8_t *delta, size_t size, uint8_t *state) const;
+
+	void ringWrite(size_t offset, const void *data, size_t size);
+	void ringRead(size_t offset, void *data, size_t size) const;
+	uint32_t readSize(size_t offset) const;
+	void dropOldest();
+	void dropNewest();
+
+	uint8_t *ring;
+	size_t capacity;
+	size_t head;			// offset where the next entry is written
+	size_t tail;			// offset of the oldest entry
+	size_t used;
+	size_t cursor;			// offset just past the entry that produced the current frame
+
+	uint32_t count;			// frames recorded, 0 when empty
+	uint32_t first;			// oldest reachable frame
+	uint32_t last;			// newest recorded frame
+	uint32_t pos;			// frame held in state
+
+	uint8_t state[STATE_SIZE];
+	uint8_t scratch[STATE_SIZE];
+	uint8_t delta[MAX_DELTA];
+};
+
+#endif
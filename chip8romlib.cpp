@@ -0,0 +1,445 @@
+#include "chip8romlib.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CHIP8ROMLIB_MMAP
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char ARCHIVE_MAGIC[8] = { 'C', 'H', 'I', 'P', '8', 'A', 'R', 'C' };
+static const uint32_t ARCHIVE_VERSION = 1;
+enum { ARCHIVE_HEADER = 64, ARCHIVE_RECORD = 24, ARCHIVE_PAGE = 0x1000 };
+
+// XXH64, as in the reference implementation. Reads are little endian.
+static const uint64_t XXH_PRIME1 = 11400714785074694791ull;
+static const uint64_t XXH_PRIME2 = 14029467366897019727ull;
+static const uint64_t XXH_PRIME3 = 1609587929392839161ull;
+static const uint64_t XXH_PRIME4 = 9650029242287828579ull;
+static const uint64_t XXH_PRIME5 = 2870177450012600261ull;
+
+static inline uint64_t xxh_rotl(uint64_t x, unsigned r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const uint8_t *p)
+{
+	uint64_t v = 0;
+	for (unsigned i = 0; i < 8; ++i)
+		v |= (uint64_t)p[i] << (8 * i);
+	return v;
+}
+
+static inline uint64_t xxh_read32(const uint8_t *p)
+{
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24);
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME2;
+	acc = xxh_rotl(acc, 31);
+	return acc * XXH_PRIME1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+uint64_t chip8romlib::hash(const void *data, size_t size)
+{
+	const uint8_t *p = static_cast<const uint8_t*>(data);
+	const uint8_t *end = p + size;
+	uint64_t h;
+	if (size >= 32)
+	{
+		uint64_t v1 = XXH_PRIME1 + XXH_PRIME2;
+		uint64_t v2 = XXH_PRIME2;
+		uint64_t v3 = 0;
+		uint64_t v4 = 0 - XXH_PRIME1;
+		for (; p + 32 <= end; p += 32)
+		{
+			v1 = xxh_round(v1, xxh_read64(p));
+			v2 = xxh_round(v2, xxh_read64(p + 8));
+			v3 = xxh_round(v3, xxh_read64(p + 16));
+			v4 = xxh_round(v4, xxh_read64(p + 24));
+		}
+		h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
+	}
+	else
+		h = XXH_PRIME5;
+
+	h += size;
+	for (; p + 8 <= end; p += 8)
+	{
+		h ^= xxh_round(0, xxh_read64(p));
+		h = xxh_rotl(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+	}
+	if (p + 4 <= end)
+	{
+		h ^= xxh_read32(p) * XXH_PRIME1;
+		h = xxh_rotl(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+		p += 4;
+	}
+	for (; p < end; ++p)
+	{
+		h ^= *p * XXH_PRIME5;
+		h = xxh_rotl(h, 11) * XXH_PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME2;
+	h ^= h >> 29;
+	h *= XXH_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+chip8romlib::chip8romlib()
+	: bucketBits(0), skippedFiles(0)
+{
+}
+
+chip8romlib::~chip8romlib()
+{
+	close();
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	return (uint32_t)xxh_read32(p);
+}
+
+static inline void put32(std::vector<uint8_t> &out, size_t at, uint32_t v)
+{
+	for (unsigned i = 0; i < 4; ++i)
+		out[at + i] = (uint8_t)(v >> (8 * i));
+}
+
+static inline void append32(std::vector<uint8_t> &out, uint32_t v)
+{
+	out.resize(out.size() + 4);
+	put32(out, out.size() - 4, v);
+}
+
+static inline uint32_t bucket_of(uint64_t hash, unsigned bits)
+{
+	return bits == 0 ? 0 : (uint32_t)(hash >> (64 - bits));
+}
+
+bool chip8romlib::open(const char *path)
+{
+	close();
+#ifdef CHIP8ROMLIB_MMAP
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return false;
+	return S_ISDIR(st.st_mode) ? openDirectory(path) : openArchive(path);
+#else
+	return false;
+#endif
+}
+
+#ifdef CHIP8ROMLIB_MMAP
+bool chip8romlib::openDirectory(const char *path)
+{
+	DIR *dir = opendir(path);
+	if (dir == NULL)
+		return false;
+
+	std::string prefix = std::string(path) + "/";
+	while (struct dirent *e = readdir(dir))
+	{
+		if (e->d_name[0] == '.')
+			continue;
+		int fd = ::open((prefix + e->d_name).c_str(), O_RDONLY | O_NONBLOCK);	// a FIFO would block until written to, S_ISREG drops it below
+		if (fd < 0)
+		{
+			++skippedFiles;
+			continue;
+		}
+		struct stat st;
+		void *base = MAP_FAILED;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= MAX_ROM)
+			base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);	// the mapping keeps the file
+		if (base == MAP_FAILED)
+		{
+			++skippedFiles;
+			continue;
+		}
+
+		mapping m = { base, (size_t)st.st_size };
+		mappings.push_back(m);
+		entry rom;
+		rom.hash = hash(base, m.size);
+		rom.data = static_cast<const uint8_t*>(base);
+		rom.size = (uint32_t)m.size;
+		rom.name = NULL;
+		entries.push_back(rom);
+		names.push_back(e->d_name);
+	}
+	closedir(dir);
+	index();
+	return true;
+}
+
+// One shared mapping for the whole archive: every process opening it reads the
+// same page cache pages, and nothing is hashed or sorted here.
+bool chip8romlib::openArchive(const char *path)
+{
+	int fd = ::open(path, O_RDONLY | O_NONBLOCK);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	void *base = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= ARCHIVE_HEADER)
+		base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (base == MAP_FAILED)
+		return false;
+
+	mapping m = { base, (size_t)st.st_size };
+	mappings.push_back(m);
+	if (!indexArchive(static_cast<const uint8_t*>(base), m.size))
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+#endif
+
+bool chip8romlib::attach(const void *archive, size_t size)
+{
+	close();
+	if (archive == NULL || !indexArchive(static_cast<const uint8_t*>(archive), size))
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool chip8romlib::isArchive(const void *data, size_t size)
+{
+	return data != NULL && size >= ARCHIVE_HEADER && memcmp(data, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) == 0;
+}
+
+// Everything the lookups follow is bounds checked; hashes are trusted, not recomputed.
+bool chip8romlib::indexArchive(const uint8_t *p, size_t size)
+{
+	if (!isArchive(p, size) || read32(p + 8) != ARCHIVE_VERSION || read32(p + 16) > 31)
+		return false;
+	uint32_t count = read32(p + 12);
+	unsigned bits = read32(p + 16);
+	uint64_t nbuckets = ((uint64_t)1 << bits) + 1;
+	uint32_t bucketsAt = read32(p + 20);
+	uint32_t recordsAt = read32(p + 24);
+	uint32_t orderAt = read32(p + 28);
+	uint32_t namesAt = read32(p + 32);
+	if (bucketsAt + nbuckets * 4 > size || recordsAt + (uint64_t)count * ARCHIVE_RECORD > size
+		|| orderAt + (uint64_t)count * 4 > size || namesAt > size)
+		return false;
+
+	entries.resize(count);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		const uint8_t *r = p + recordsAt + (size_t)i * ARCHIVE_RECORD;
+		uint32_t data = read32(r + 8);
+		uint32_t length = read32(r + 12);
+		uint32_t name = read32(r + 16);
+		if (length == 0 || length > MAX_ROM || data + (uint64_t)length > size
+			|| name < namesAt || name >= size || memchr(p + name, 0, size - name) == NULL)
+			return false;
+		entries[i].hash = xxh_read64(r);
+		entries[i].data = p + data;
+		entries[i].size = length;
+		entries[i].name = reinterpret_cast<const char*>(p + name);
+		if (i > 0 && entries[i].hash < entries[i - 1].hash)
+			return false;
+	}
+
+	byName.resize(count);
+	for (uint32_t i = 0; i < count; ++i)
+		if ((byName[i] = read32(p + orderAt + (size_t)i * 4)) >= count)
+			return false;
+
+	bucketBits = bits;
+	buckets.resize((size_t)nbuckets);
+	for (size_t b = 0; b < buckets.size(); ++b)
+		if ((buckets[b] = read32(p + bucketsAt + b * 4)) > count || (b > 0 && buckets[b] < buckets[b - 1]))
+			return false;
+	return buckets.back() == count;
+}
+
+// Names are pointed at once names has stopped growing, then both orders are built.
+void chip8romlib::index()
+{
+	for (size_t i = 0; i < entries.size(); ++i)
+		entries[i].name = names[i].c_str();
+	std::sort(entries.begin(), entries.end(), [](const entry &a, const entry &b)
+	{
+		return a.hash < b.hash || (a.hash == b.hash && strcmp(a.name, b.name) < 0);
+	});
+
+	byName.resize(entries.size());
+	for (size_t i = 0; i < entries.size(); ++i)
+		byName[i] = (uint32_t)i;
+	std::sort(byName.begin(), byName.end(), [this](uint32_t a, uint32_t b)
+	{
+		return strcmp(entries[a].name, entries[b].name) < 0;
+	});
+	buildBuckets();
+}
+
+// About one entry per bucket: the smallest power of two at least the entry count.
+void chip8romlib::buildBuckets()
+{
+	bucketBits = 0;
+	while (((size_t)1 << bucketBits) < entries.size())
+		++bucketBits;
+	buckets.resize(((size_t)1 << bucketBits) + 1);
+	size_t i = 0;
+	for (size_t b = 0; b < buckets.size(); ++b)
+	{
+		while (i < entries.size() && bucket_of(entries[i].hash, bucketBits) < b)
+			++i;
+		buckets[b] = (uint32_t)i;
+	}
+}
+
+void chip8romlib::close()
+{
+#ifdef CHIP8ROMLIB_MMAP
+	for (size_t i = 0; i < mappings.size(); ++i)
+		munmap(mappings[i].base, mappings[i].size);
+#endif
+	mappings.clear();
+	entries.clear();
+	byName.clear();
+	buckets.clear();
+	bucketBits = 0;
+	names.clear();
+	skippedFiles = 0;
+}
+
+// Identical ROMs under different names share one payload; they sort next to
+// each other by hash.
+bool chip8romlib::write(const char *path) const
+{
+	std::vector<uint32_t> table = buckets.empty() ? std::vector<uint32_t>(2, 0) : buckets;
+	uint32_t count = (uint32_t)entries.size();
+	std::vector<uint8_t> out(ARCHIVE_HEADER);
+	memcpy(&out[0], ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+	put32(out, 8, ARCHIVE_VERSION);
+	put32(out, 12, count);
+	put32(out, 16, bucketBits);
+
+	put32(out, 20, (uint32_t)out.size());
+	for (size_t b = 0; b < table.size(); ++b)
+		append32(out, table[b]);
+	size_t recordsAt = out.size();
+	put32(out, 24, (uint32_t)recordsAt);
+	out.resize(out.size() + (size_t)count * ARCHIVE_RECORD);
+	put32(out, 28, (uint32_t)out.size());
+	for (uint32_t i = 0; i < count; ++i)
+		append32(out, byName[i]);
+	put32(out, 32, (uint32_t)out.size());
+	std::vector<size_t> nameAt(count);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		nameAt[i] = out.size();
+		out.insert(out.end(), entries[i].name, entries[i].name + strlen(entries[i].name) + 1);
+	}
+	out.resize((out.size() + ARCHIVE_PAGE - 1) & ~(size_t)(ARCHIVE_PAGE - 1));
+	put32(out, 36, (uint32_t)out.size());
+
+	std::vector<size_t> dataAt(count);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		const entry &e = entries[i];
+		dataAt[i] = 0;
+		for (uint32_t j = i; j-- > 0 && entries[j].hash == e.hash && dataAt[i] == 0;)
+			if (entries[j].size == e.size && memcmp(entries[j].data, e.data, e.size) == 0)
+				dataAt[i] = dataAt[j];
+		if (dataAt[i] != 0)
+			continue;
+		dataAt[i] = out.size();
+		out.insert(out.end(), e.data, e.data + e.size);
+		out.resize((out.size() + ARCHIVE_PAGE - 1) & ~(size_t)(ARCHIVE_PAGE - 1));
+	}
+	if (out.size() > 0xFFFFFFFFu)
+		return false;
+	put32(out, 40, (uint32_t)out.size());
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		size_t r = recordsAt + (size_t)i * ARCHIVE_RECORD;
+		put32(out, r, (uint32_t)entries[i].hash);
+		put32(out, r + 4, (uint32_t)(entries[i].hash >> 32));
+		put32(out, r + 8, (uint32_t)dataAt[i]);
+		put32(out, r + 12, entries[i].size);
+		put32(out, r + 16, (uint32_t)nameAt[i]);
+	}
+
+	// Readers may have the old archive mapped: replace it, never rewrite it.
+	std::string temp = std::string(path) + ".tmp";
+	FILE *f = fopen(temp.c_str(), "wb");
+	if (f == NULL)
+		return false;
+	bool ok = fwrite(&out[0], 1, out.size(), f) == out.size();
+	ok = fclose(f) == 0 && ok;
+	if (!ok || rename(temp.c_str(), path) != 0)
+	{
+		remove(temp.c_str());
+		return false;
+	}
+	return true;
+}
+
+const chip8romlib::entry *chip8romlib::find(uint64_t hash) const
+{
+	if (buckets.empty())
+		return NULL;
+	uint32_t b = bucket_of(hash, bucketBits);
+	for (uint32_t i = buckets[b]; i < buckets[b + 1]; ++i)
+		if (entries[i].hash == hash)
+			return &entries[i];
+	return NULL;
+}
+
+const chip8romlib::entry *chip8romlib::find(const char *name) const
+{
+	std::vector<uint32_t>::const_iterator it = std::lower_bound(byName.begin(), byName.end(), name,
+		[this](uint32_t i, const char *n) { return strcmp(entries[i].name, n) < 0; });
+	return it != byName.end() && strcmp(entries[*it].name, name) == 0 ? &entries[*it] : NULL;
+}
+
+const chip8romlib::entry *chip8romlib::lookup(const char *key) const
+{
+	const entry *e = find(key);
+	if (e != NULL || strlen(key) != 16 || strspn(key, "0123456789abcdefABCDEF") != 16)
+		return e;
+	return find((uint64_t)strtoull(key, NULL, 16));
+}
+
+bool chip8romlib::load(const entry &rom, chip8 &emu)
+{
+	emu.Reset();
+	return emu.loadApplication(rom.data, rom.size);
+}
@@ -0,0 +1,78 @@
+#ifndef CHIP8ROMLIB_H
+#define CHIP8ROMLIB_H
+
+#include "chip8.h"
+
+#include <string>
+#include <vector>
+
+// Read-only ROM library, indexed by XXH64 of each ROM's contents and by file
+// name. open() takes a directory, whose files that fit in chip8 memory are each
+// mapped, or a packed archive, which is mapped whole. Either way loading a ROM
+// into a machine is one memcpy from the page cache, however many machines or
+// processes take it.
+//
+// Archive layout, little endian, written by write():
+//   header   64 bytes: "CHIP8ARC", version, count, bucket bits and the
+//            offsets of the tables below, the rest zero
+//   buckets  (1 << bits) + 1 u32: first record whose hash's top bits are >= b
+//   records  count x { u64 hash, u32 data, u32 size, u32 name, u32 0 }, by hash then name
+//   order    count u32 record indices, by name
+//   names    NUL terminated
+//   data     one page-aligned payload per distinct ROM
+// A hash is found by scanning its bucket, about one record.
+class chip8romlib
+{
+public:
+	enum { MAX_ROM = 0x1000 - 0x200 };
+
+	struct entry
+	{
+		uint64_t hash;			// XXH64, seed 0, of data
+		const uint8_t *data;
+		uint32_t size;
+		const char *name;		// file name, without the directory
+	};
+
+	chip8romlib();
+	~chip8romlib();
+
+	bool open(const char *path);	// false when path is neither a listable directory nor a valid archive; unreadable or oversized files are skipped
+	bool attach(const void *archive, size_t size);	// index an archive already in memory, which must outlive the library
+	void close();
+	bool write(const char *path) const;		// pack the open library into an archive, through a temporary renamed over path
+
+	size_t size() const { return entries.size(); }
+	const entry &rom(size_t i) const { return entries[i]; }		// in hash order
+	const entry *find(uint64_t hash) const;
+	const entry *find(const char *name) const;
+	const entry *lookup(const char *key) const;		// by name, else by 16 hex digit hash
+	size_t skipped() const { return skippedFiles; }			// files left out by open()
+
+	static bool isArchive(const void *data, size_t size);
+	static bool load(const entry &rom, chip8 &emu);			// Reset and loadApplication
+	static uint64_t hash(const void *data, size_t size);	// XXH64 with seed 0
+
+private:
+	struct mapping
+	{
+		void *base;
+		size_t size;
+	};
+
+	bool openDirectory(const char *path);
+	bool openArchive(const char *path);
+	bool indexArchive(const uint8_t *data, size_t size);
+	void index();
+	void buildBuckets();
+
+	std::vector<entry> entries;
+	std::vector<uint32_t> byName;		// entries indices in name order
+	std::vector<uint32_t> buckets;		// as in the archive, on the top bucketBits of the hash
+	unsigned bucketBits;
+	std::vector<mapping> mappings;
+	std::vector<std::string> names;		// what entry::name points into for directories, never resized once indexed
+	size_t skippedFiles;
+};
+
+#endif
@@ -0,0 +1,872 @@
+// Headless runner: loads ROMs straight into chip8, runs them for a number of
+// frames with scripted input and reports throughput and a framebuffer hash.
+// Meant for regression and throughput sweeps without a libretro frontend.
+#include <algorithm>
+#include <chrono>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+#include "chip8explore.h"
+#include "chip8farm.h"
+#include "chip8lanes.h"
+#include "chip8romlib.h"
+#ifdef CHIP8_JIT
+#include "chip8jit.h"
+#endif
+#ifdef CHIP8_PROFILE
+#include "chip8profile.h"
+#endif
+#ifdef CHIP8_PERF
+#include "chip8perf.h"
+#endif
+
+// Keys held from a frame on, until the next event.
+struct input_event
+{
+	unsigned frame;
+	uint16_t keys;		// bit k set when key k is down
+};
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s [options] rom...\n"
+		"       %s [options] -R DIR|ARCHIVE [name|xxh64...]\n"
+		"  -f N       frames to run (default 600)\n"
+		"  -i N       instructions per frame (default 10)\n"
+		"  -s N       CXNN seed (default 1), with -n instance i uses N + i\n"
+		"  -n N       run N instances of each ROM on a thread pool\n"
+		"  -t N       worker threads for -n (default: one per core)\n"
+		"  -p         with -n, instance i also holds key i %% 16 throughout\n"
+		"  -L         with -n, run the instances 16 to a vector on the lane\n"
+		"             interpreter, on the calling thread\n"
+		"  -x N       breadth-first search from the start of each ROM until N\n"
+		"             distinct states are known\n"
+		"  -e KEYS    with -x, hex key digits to branch on, each held alone, plus\n"
+		"             no key (default: all 16)\n"
+		"  -F N       with -x, frames per search step (default 6)\n"
+		"  -D         check the lane interpreter"
+#ifdef CHIP8_JIT
+		" and the block translator"
+#endif
+		" against the\n"
+		"             reference interpreter every frame, on 16 machines per ROM\n"
+		"  -R LIB     run ROMs from a directory or chip8pack archive, mapped once:\n"
+		"             the entries given by file name or XXH64, or all of them\n"
+		"  -k SCRIPT  input script, FRAME:KEYS entries separated by commas or\n"
+		"             whitespace, KEYS being hex key digits held from FRAME on or\n"
+		"             '-' for none, e.g. \"0:-,60:5,90:46\"; @FILE reads it from FILE\n"
+#ifdef CHIP8_JIT
+		"  -j         run through the block translator\n"
+#endif
+#ifdef CHIP8_PERF
+		"  -C         report hardware counters per frame and per million\n"
+		"             emulated instructions for each timed run\n"
+#endif
+#ifdef CHIP8_PROFILE
+		"  -P FILE    write an opcode and hot address profile of each ROM to FILE,\n"
+		"             CSV when it ends in .csv, JSON otherwise, '-' for stdout;\n"
+		"             single instance interpreter runs only\n"
+#endif
+		, argv0, argv0);
+}
+
+static bool parse_unsigned(const char *s, unsigned &out)
+{
+	char *end;
+	unsigned long v = strtoul(s, &end, 10);
+	if (*s == '\0' || *end != '\0' || v > 0xFFFFFFFFul)
+		return false;
+	out = (unsigned)v;
+	return true;
+}
+
+static bool read_file(const char *path, std::vector<uint8_t> &out)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+		return false;
+	out.clear();
+	uint8_t buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		out.insert(out.end(), buf, buf + n);
+	bool ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
+
+static bool parse_script(const char *text, std::vector<input_event> &events)
+{
+	const char *p = text;
+	for (;;)
+	{
+		while (*p == ',' || isspace((unsigned char)*p))
+			++p;
+		if (*p == '#')
+		{
+			while (*p != '\0' && *p != '\n')
+				++p;
+			continue;
+		}
+		if (*p == '\0')
+			break;
+
+		char *end;
+		input_event e;
+		e.frame = (unsigned)strtoul(p, &end, 10);
+		if (end == p || *end != ':')
+			return false;
+		p = end + 1;
+
+		e.keys = 0;
+		if (*p == '-')
+			++p;
+		else if (!isxdigit((unsigned char)*p))
+			return false;
+		for (; isxdigit((unsigned char)*p); ++p)
+		{
+			char digit[2] = { *p, '\0' };
+			e.keys |= 1u << strtoul(digit, NULL, 16);
+		}
+		if (*p != '\0' && *p != ',' && !isspace((unsigned char)*p))
+			return false;
+
+		// keep the script ordered by frame, later entries win on ties
+		std::vector<input_event>::iterator it = events.end();
+		while (it != events.begin() && (it - 1)->frame > e.frame)
+			--it;
+		events.insert(it, e);
+	}
+	return true;
+}
+
+// FNV-1a over the rows, MSB first so the value does not depend on host endianness.
+static uint64_t hash_display(const chip8 &emu)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	for (unsigned y = 0; y < SCREEN_Y; ++y)
+		for (int shift = 56; shift >= 0; shift -= 8)
+		{
+			h ^= (emu.gfx[y] >> shift) & 0xFF;
+			h *= 0x100000001b3ull;
+		}
+	return h;
+}
+
+// A ROM to run, read up front from a file or mapped by the ROM library.
+struct rom_image
+{
+	std::string name;
+	const uint8_t *data;
+	size_t size;
+};
+
+static bool load_rom(chip8 &emu, const rom_image &rom)
+{
+	emu.Reset();
+	if (!emu.loadApplication(rom.data, rom.size))
+	{
+		fprintf(stderr, "%s: cannot load ROM\n", rom.name.c_str());
+		return false;
+	}
+	return true;
+}
+
+#ifdef CHIP8_PERF
+static chip8perf *counters;		// -C, NULL when off or nothing could be opened
+#endif
+
+// Bracket the timed part of every run mode.
+static void counters_start()
+{
+#ifdef CHIP8_PERF
+	if (counters != NULL)
+	{
+		counters->reset();
+		counters->start();
+	}
+#endif
+}
+
+static void counters_stop(uint64_t frames, uint64_t insns)
+{
+#ifdef CHIP8_PERF
+	if (counters != NULL)
+	{
+		counters->stop();
+		counters->addWork(frames, insns);
+	}
+#else
+	(void)frames;
+	(void)insns;
+#endif
+}
+
+// A line of its own after the run's report.
+static void counters_report(const char *path)
+{
+#ifdef CHIP8_PERF
+	if (counters == NULL)
+		return;
+	char text[512];
+	counters->format(text, sizeof(text));
+	printf("%s perf: %s\n", path, text);
+#else
+	(void)path;
+#endif
+}
+
+struct farm_input
+{
+	const std::vector<uint16_t> *keys;
+	bool permute;
+};
+
+static uint16_t farm_keys(unsigned instance, unsigned frame, void *user)
+{
+	const farm_input *in = static_cast<const farm_input*>(user);
+	uint16_t keys = (*in->keys)[frame];
+	if (in->permute)
+		keys |= 1u << (instance % 16);
+	return keys;
+}
+
+// Every ROM runs on all instances at once. Rates are totals over the farm,
+// fb is instance 0's display and distinct the number of different displays.
+static int run_farm(const std::vector<rom_image> &roms, const std::vector<uint16_t> &keys, unsigned frames, unsigned ipf,
+	unsigned seed, unsigned instances, unsigned threads, bool permute)
+{
+	static chip8farm farm;
+	if (!farm.init(instances, threads))
+	{
+		fprintf(stderr, "cannot set up %u instances\n", instances);
+		return 1;
+	}
+	farm_input in = { &keys, permute };
+	farm.setInput(farm_keys, &in);
+
+	int status = 0;
+	for (size_t r = 0; r < roms.size(); ++r)
+	{
+		const char *path = roms[r].name.c_str();
+		bool loaded = true;
+		for (unsigned i = 0; i < instances && loaded; ++i)
+		{
+			farm.machine(i).setSeed(seed + i);
+			loaded = load_rom(farm.machine(i), roms[r]);
+		}
+		if (!loaded)
+		{
+			status = 1;
+			continue;
+		}
+
+		counters_start();
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		farm.run(frames, ipf);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		uint64_t insns = 0;
+		unsigned stopped = 0;
+		for (unsigned i = 0; i < instances; ++i)
+		{
+			insns += farm.machine(i).retired();
+			stopped += !farm.machine(i).run;
+		}
+		counters_stop((uint64_t)frames * instances, insns);
+
+		std::vector<uint64_t> hashes(instances);
+		for (unsigned i = 0; i < instances; ++i)
+			hashes[i] = hash_display(farm.machine(i));
+		uint64_t first = hashes[0];
+		std::sort(hashes.begin(), hashes.end());
+		size_t distinct = std::unique(hashes.begin(), hashes.end()) - hashes.begin();
+
+		double insn_rate = seconds > 0 ? insns / seconds : 0;
+		double frame_rate = seconds > 0 ? (double)frames * instances / seconds : 0;
+		printf("%s instances=%u threads=%u frames=%u ipf=%u insns=%llu seconds=%.6f insn/s=%.0f frames/s=%.1f fb=%016llx distinct=%zu stopped=%u\n",
+			path, instances, farm.threads(), frames, ipf, (unsigned long long)insns, seconds, insn_rate, frame_rate,
+			(unsigned long long)first, distinct, stopped);
+		counters_report(path);
+	}
+	farm.deinit();
+	return status;
+}
+
+// Same report as run_farm, from groups of chip8lanes::LANES instances.
+static int run_lanes(const std::vector<rom_image> &roms, const std::vector<uint16_t> &keys, unsigned frames, unsigned ipf,
+	unsigned seed, unsigned instances, bool permute)
+{
+	unsigned ngroups = (instances + chip8lanes::LANES - 1) / chip8lanes::LANES;
+	std::vector<chip8lanes *> groups(ngroups);
+	for (unsigned g = 0; g < ngroups; ++g)
+		groups[g] = new chip8lanes;
+	farm_input in = { &keys, permute };
+	static chip8 emu;
+
+	int status = 0;
+	for (size_t r = 0; r < roms.size(); ++r)
+	{
+		const char *path = roms[r].name.c_str();
+		if (!load_rom(emu, roms[r]))
+		{
+			status = 1;
+			continue;
+		}
+		for (unsigned g = 0; g < ngroups; ++g)
+		{
+			*groups[g] = chip8lanes();
+			for (unsigned lane = 0; lane < chip8lanes::LANES && g * chip8lanes::LANES + lane < instances; ++lane)
+			{
+				emu.setSeed(seed + g * chip8lanes::LANES + lane);
+				groups[g]->load(lane, emu);
+			}
+		}
+
+		uint64_t steps = 0;
+		uint64_t retired = 0;
+		counters_start();
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		for (unsigned g = 0; g < ngroups; ++g)
+		{
+			chip8lanes &group = *groups[g];
+			for (unsigned frame = 0; frame < frames; ++frame)
+			{
+				for (unsigned lane = 0; lane < chip8lanes::LANES; ++lane)
+					group.setKeys(lane, farm_keys(g * chip8lanes::LANES + lane, frame, &in));
+				group.runFrame(ipf);
+			}
+			steps += group.steps();
+			retired += group.instructions();
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		uint64_t insns = 0;
+		unsigned stopped = 0;
+		for (unsigned i = 0; i < instances; ++i)
+		{
+			const chip8lanes &group = *groups[i / chip8lanes::LANES];
+			insns += group.retired(i % chip8lanes::LANES);
+			stopped += !group.running(i % chip8lanes::LANES);
+		}
+		counters_stop((uint64_t)frames * instances, insns);
+
+		std::vector<uint64_t> hashes;
+		for (unsigned i = 0; i < instances; ++i)
+		{
+			groups[i / chip8lanes::LANES]->store(i % chip8lanes::LANES, emu);
+			hashes.push_back(hash_display(emu));
+		}
+		uint64_t first = hashes[0];
+		std::sort(hashes.begin(), hashes.end());
+		size_t distinct = std::unique(hashes.begin(), hashes.end()) - hashes.begin();
+
+		double insn_rate = seconds > 0 ? insns / seconds : 0;
+		double frame_rate = seconds > 0 ? (double)frames * instances / seconds : 0;
+		printf("%s instances=%u lanes=%u frames=%u ipf=%u insns=%llu seconds=%.6f insn/s=%.0f frames/s=%.1f fb=%016llx distinct=%zu stopped=%u lanes/step=%.2f\n",
+			path, instances, (unsigned)chip8lanes::LANES, frames, ipf, (unsigned long long)insns, seconds, insn_rate, frame_rate,
+			(unsigned long long)first, distinct, stopped, steps > 0 ? (double)retired / steps : 0.0);
+		counters_report(path);
+	}
+	for (unsigned g = 0; g < ngroups; ++g)
+		delete groups[g];
+	return status;
+}
+
+// Field where two savestates first differ, NULL when they are the same.
+static const char *state_diff(const chip8_savestate &a, const chip8_savestate &b)
+{
+	if (a.pc != b.pc)
+		return "pc";
+	if (a.I != b.I)
+		return "I";
+	if (a.sp != b.sp || memcmp(a.stack, b.stack, sizeof(a.stack)) != 0)
+		return "stack";
+	if (memcmp(a.V, b.V, sizeof(a.V)) != 0)
+		return "V";
+	if (a.delay_timer != b.delay_timer || a.sound_timer != b.sound_timer)
+		return "timers";
+	if (a.run != b.run)
+		return "run";
+	if (memcmp(a.gfx, b.gfx, sizeof(a.gfx)) != 0)
+		return "display";
+	if (memcmp(a.memory, b.memory, sizeof(a.memory)) != 0)
+		return "memory";
+	if (a.rng != b.rng)
+		return "rng";
+	return memcmp(&a, &b, sizeof(a)) != 0 ? "state" : NULL;
+}
+
+// Differential check of the other engines against chip8::runFrame, the
+// reference. Each ROM runs on LANES machines, machine i with seed + i and key
+// i held on top of the script. After every frame the lane interpreter's and,
+// when built in, the translator's machines must match the reference's
+// savestates exactly. Stops a ROM at its first divergence.
+static int run_check(const std::vector<rom_image> &roms, const std::vector<uint16_t> &keys, unsigned frames, unsigned ipf,
+	unsigned seed)
+{
+	enum { MACHINES = chip8lanes::LANES };
+	static chip8 ref[MACHINES];
+	static chip8 stored;
+	static chip8lanes lanes;
+	static chip8_savestate want, got;	// static like the machines, over 4 KB each
+#ifdef CHIP8_JIT
+	static chip8 translated[MACHINES];
+	static chip8jit jit[MACHINES];	// one each, a block cache follows one machine's memory
+	bool use_jit = true;
+	for (unsigned i = 0; i < MACHINES && use_jit; ++i)
+		use_jit = jit[i].init();
+	const char *engines = use_jit ? "lanes,jit" : "lanes";
+	if (!use_jit)
+		fprintf(stderr, "JIT unavailable, checking the lane interpreter only.\n");
+#else
+	const char *engines = "lanes";
+#endif
+	farm_input in = { &keys, true };
+
+	int status = 0;
+	for (size_t r = 0; r < roms.size(); ++r)
+	{
+		const char *path = roms[r].name.c_str();
+		lanes = chip8lanes();
+		bool loaded = true;
+		for (unsigned i = 0; i < MACHINES && loaded; ++i)
+		{
+			ref[i].setSeed(seed + i);
+			loaded = load_rom(ref[i], roms[r]) && lanes.load(i, ref[i]);
+#ifdef CHIP8_JIT
+			translated[i].setSeed(seed + i);
+			loaded = loaded && load_rom(translated[i], roms[r]);
+			jit[i].flush();
+#endif
+		}
+		if (!loaded)
+		{
+			status = 1;
+			continue;
+		}
+
+		const char *diverged = NULL;
+		const char *engine = NULL;
+		unsigned machine = 0;
+		unsigned frame = 0;
+		for (; frame < frames && diverged == NULL; ++frame)
+		{
+			for (unsigned i = 0; i < MACHINES; ++i)
+			{
+				uint16_t held = farm_keys(i, frame, &in);
+				for (unsigned k = 0; k < 16; ++k)
+					ref[i].keypad[k] = (held >> k) & 1;
+				ref[i].runFrame(ipf);
+				lanes.setKeys(i, held);
+#ifdef CHIP8_JIT
+				if (use_jit)
+				{
+					memcpy(translated[i].keypad, ref[i].keypad, sizeof(translated[i].keypad));
+					jit[i].runFrame(translated[i], ipf);
+				}
+#endif
+			}
+			lanes.runFrame(ipf);
+
+			for (unsigned i = 0; i < MACHINES && diverged == NULL; ++i)
+			{
+				ref[i].serialize(&want, sizeof(want));
+				lanes.store(i, stored);
+				stored.serialize(&got, sizeof(got));
+				if ((diverged = state_diff(want, got)) != NULL)
+				{
+					engine = "lanes";
+					machine = i;
+					break;
+				}
+#ifdef CHIP8_JIT
+				translated[i].serialize(&got, sizeof(got));
+				if (use_jit && (diverged = state_diff(want, got)) != NULL)
+				{
+					engine = "jit";
+					machine = i;
+				}
+#endif
+			}
+		}
+
+		if (diverged != NULL)
+		{
+			printf("%s ipf=%u engines=%s DIVERGED: %s machine %u %s at frame %u, pc %03x vs %03x\n",
+				path, ipf, engines, engine, machine, diverged, frame - 1, want.pc, got.pc);
+			status = 1;
+		}
+		else
+			printf("%s frames=%u ipf=%u machines=%u engines=%s ok fb=%016llx\n",
+				path, frames, ipf, (unsigned)MACHINES, engines, (unsigned long long)hash_display(ref[0]));
+	}
+	return status;
+}
+
+// Breadth-first search over inputs. Reports the states found and how many
+// memory pages they needed, against the time it took.
+static int run_explore(const std::vector<rom_image> &roms, const char *branch_keys, unsigned nodes, unsigned step, unsigned ipf,
+	unsigned seed)
+{
+	std::vector<uint16_t> inputs(1, 0);
+	for (const char *p = branch_keys; *p != '\0'; ++p)
+	{
+		char digit[2] = { *p, '\0' };
+		inputs.push_back((uint16_t)(1u << strtoul(digit, NULL, 16)));
+	}
+
+	static chip8 emu;
+	static chip8explore search;
+	int status = 0;
+	for (size_t r = 0; r < roms.size(); ++r)
+	{
+		const char *path = roms[r].name.c_str();
+		emu.setSeed(seed);
+		if (!load_rom(emu, roms[r]) || !search.init(emu, &inputs[0], (unsigned)inputs.size(), step, ipf))
+		{
+			status = 1;
+			continue;
+		}
+
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		unsigned found = search.run(nodes);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+		printf("%s nodes=%u expanded=%u depth=%u pages=%u duplicates=%llu seconds=%.6f nodes/s=%.0f\n",
+			path, found, search.expanded(), search.depth(found - 1), search.pages(),
+			(unsigned long long)search.duplicates(), seconds, seconds > 0 ? found / seconds : 0.0);
+	}
+	return status;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned frames = 600;
+	unsigned ipf = 10;
+	unsigned seed = 1;
+	unsigned instances = 1;
+	unsigned threads = 0;
+	bool permute = false;
+	bool use_lanes = false;
+	unsigned explore = 0;
+	const char *library_path = NULL;
+	bool check = false;
+	unsigned step = 6;
+	const char *branch_keys = "0123456789abcdef";
+#ifdef CHIP8_JIT
+	bool use_jit = false;
+#endif
+#ifdef CHIP8_PROFILE
+	const char *profile_path = NULL;
+#endif
+#ifdef CHIP8_PERF
+	bool use_counters = false;
+#endif
+	std::vector<input_event> script;
+
+	int arg = 1;
+	for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0'; ++arg)
+	{
+		const char *opt = argv[arg];
+		if (strcmp(opt, "--") == 0)
+		{
+			++arg;
+			break;
+		}
+#ifdef CHIP8_JIT
+		if (strcmp(opt, "-j") == 0)
+		{
+			use_jit = true;
+			continue;
+		}
+#endif
+		if (strcmp(opt, "-p") == 0)
+		{
+			permute = true;
+			continue;
+		}
+		if (strcmp(opt, "-L") == 0)
+		{
+			use_lanes = true;
+			continue;
+		}
+		if (strcmp(opt, "-D") == 0)
+		{
+			check = true;
+			continue;
+		}
+#ifdef CHIP8_PERF
+		if (strcmp(opt, "-C") == 0)
+		{
+			use_counters = true;
+			continue;
+		}
+#endif
+#ifdef CHIP8_PROFILE
+		if (strcmp(opt, "-P") == 0 && arg + 1 < argc)
+		{
+			profile_path = argv[++arg];
+			continue;
+		}
+#endif
+		if (opt[2] != '\0' || strchr("fisknxeFRt", opt[1]) == NULL || arg + 1 >= argc)
+		{
+			usage(argv[0]);
+			return 2;
+		}
+
+		const char *value = argv[++arg];
+		bool ok = true;
+		switch (opt[1])
+		{
+		case 'f': ok = parse_unsigned(value, frames); break;
+		case 'i': ok = parse_unsigned(value, ipf) && ipf > 0; break;
+		case 's': ok = parse_unsigned(value, seed); break;
+		case 'n': ok = parse_unsigned(value, instances) && instances > 0; break;
+		case 't': ok = parse_unsigned(value, threads); break;
+		case 'x': ok = parse_unsigned(value, explore) && explore > 0; break;
+		case 'R': library_path = value; break;
+		case 'F': ok = parse_unsigned(value, step) && step > 0; break;
+		case 'e':
+			branch_keys = value;
+			for (const char *p = value; *p != '\0' && ok; ++p)
+				ok = isxdigit((unsigned char)*p) != 0;
+			ok = ok && strlen(value) <= 16;
+			break;
+		case 'k':
+			if (value[0] == '@')
+			{
+				std::vector<uint8_t> text;
+				ok = read_file(value + 1, text);
+				if (!ok)
+				{
+					fprintf(stderr, "%s: cannot read input script\n", value + 1);
+					return 2;
+				}
+				text.push_back('\0');
+				ok = parse_script((const char *)&text[0], script);
+			}
+			else
+			{
+				ok = parse_script(value, script);
+			}
+			break;
+		}
+		if (!ok)
+		{
+			fprintf(stderr, "invalid value for %s: %s\n", opt, value);
+			return 2;
+		}
+	}
+	if (arg == argc && library_path == NULL)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+
+	// Files named on the command line, or -R library entries named by file name
+	// or XXH64 (16 hex digits), every entry when none is named.
+	static chip8romlib library;
+	std::vector<std::vector<uint8_t> > files(argc - arg);
+	std::vector<rom_image> roms;
+	int status = 0;
+	if (library_path != NULL)
+	{
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		if (!library.open(library_path))
+		{
+			fprintf(stderr, "%s: cannot open ROM library\n", library_path);
+			return 2;
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		fprintf(stderr, "%s: %zu ROMs opened in %.3f ms, %zu files skipped\n", library_path, library.size(),
+			seconds * 1e3, library.skipped());
+
+		for (size_t i = 0; arg == argc && i < library.size(); ++i)
+		{
+			rom_image image = { library.rom(i).name, library.rom(i).data, library.rom(i).size };
+			roms.push_back(image);
+		}
+		for (int a = arg; a < argc; ++a)
+		{
+			const chip8romlib::entry *e = library.lookup(argv[a]);
+			if (e == NULL)
+			{
+				fprintf(stderr, "%s: not in %s\n", argv[a], library_path);
+				status = 1;
+				continue;
+			}
+			rom_image image = { e->name, e->data, e->size };
+			roms.push_back(image);
+		}
+	}
+	else
+	{
+		for (int a = arg; a < argc; ++a)
+		{
+			std::vector<uint8_t> &file = files[a - arg];
+			if (!read_file(argv[a], file))
+			{
+				fprintf(stderr, "%s: cannot load ROM\n", argv[a]);
+				status = 1;
+				continue;
+			}
+			rom_image image = { argv[a], file.empty() ? NULL : &file[0], file.size() };
+			roms.push_back(image);
+		}
+	}
+
+	// keys held during each frame, flattened from the script
+	std::vector<uint16_t> keys(frames);
+	size_t next = 0;
+	uint16_t held = 0;
+	for (unsigned frame = 0; frame < frames; ++frame)
+	{
+		for (; next < script.size() && script[next].frame <= frame; ++next)
+			held = script[next].keys;
+		keys[frame] = held;
+	}
+
+#ifdef CHIP8_PERF
+	// opened before any farm thread exists, so the workers inherit the counters
+	static chip8perf perf;
+	if (use_counters)
+	{
+		unsigned opened = perf.open();
+		if (opened == 0)
+			fprintf(stderr, "hardware counters unavailable (%s), not measuring\n", perf.error());
+		else
+		{
+			if (opened < chip8perf::COUNTERS)
+				fprintf(stderr, "some hardware counters unavailable (%s)\n", perf.error());
+			counters = &perf;
+		}
+	}
+#endif
+
+	if (check)
+	{
+		int checked = run_check(roms, keys, frames, ipf, seed);
+		return checked != 0 ? checked : status;
+	}
+
+	int ran = 0;
+	if (explore > 0)
+		ran = run_explore(roms, branch_keys, explore, step, ipf, seed);
+	else if (instances > 1 && use_lanes)
+		ran = run_lanes(roms, keys, frames, ipf, seed, instances, permute);
+	else if (instances > 1)
+		ran = run_farm(roms, keys, frames, ipf, seed, instances, threads, permute);
+	if (explore > 0 || instances > 1)
+		return ran != 0 ? ran : status;
+
+	static chip8 emu;
+#ifdef CHIP8_JIT
+	static chip8jit jit;
+	if (use_jit && !jit.init())
+	{
+		fprintf(stderr, "JIT unavailable, interpreting.\n");
+		use_jit = false;
+	}
+#endif
+
+#ifdef CHIP8_PROFILE
+	static chip8_profile profile;
+	FILE *profile_out = NULL;
+	bool profile_csv = false;
+	unsigned profiled = 0;
+	if (profile_path != NULL)
+	{
+		size_t len = strlen(profile_path);
+		profile_csv = len >= 4 && strcmp(profile_path + len - 4, ".csv") == 0;
+		profile_out = strcmp(profile_path, "-") == 0 ? stdout : fopen(profile_path, "w");
+		if (profile_out == NULL)
+		{
+			fprintf(stderr, "%s: cannot write profile\n", profile_path);
+			return 2;
+		}
+		emu.setProfile(&profile);
+		if (!profile_csv)
+			fputs("[", profile_out);
+	}
+#endif
+
+	for (size_t r = 0; r < roms.size(); ++r)
+	{
+		const char *path = roms[r].name.c_str();
+		emu.setSeed(seed);
+		if (!load_rom(emu, roms[r]))
+		{
+			status = 1;
+			continue;
+		}
+#ifdef CHIP8_PROFILE
+		chip8_profile_clear(&profile);
+#endif
+
+		counters_start();
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		unsigned ran = 0;
+		while (ran < frames && emu.run)
+		{
+			for (unsigned k = 0; k < 16; ++k)
+				emu.keypad[k] = (keys[ran] >> k) & 1;
+#ifdef CHIP8_JIT
+			if (use_jit)
+				jit.runFrame(emu, ipf);
+			else
+#endif
+			emu.runFrame(ipf);
+			++ran;
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		uint64_t insns = emu.retired();
+		counters_stop(ran, insns);
+
+		// Rates only mean something for a machine that ran the whole time.
+		if (!emu.run)
+			printf("%s frames=%u ipf=%u insns=%llu stopped in frame %u fb=%016llx\n",
+				path, frames, ipf, (unsigned long long)insns, ran - 1, (unsigned long long)hash_display(emu));
+		else
+		{
+			double insn_rate = seconds > 0 ? insns / seconds : 0;
+			double frame_rate = seconds > 0 ? ran / seconds : 0;
+			printf("%s frames=%u ipf=%u insns=%llu seconds=%.6f insn/s=%.0f frames/s=%.1f fb=%016llx\n",
+				path, frames, ipf, (unsigned long long)insns, seconds, insn_rate, frame_rate,
+				(unsigned long long)hash_display(emu));
+		}
+		counters_report(path);
+#ifdef CHIP8_PROFILE
+		if (profile_out != NULL)
+		{
+			if (profile_csv)
+				chip8_profile_write_csv(&profile, path, profiled == 0, profile_out);
+			else
+			{
+				fputs(profiled == 0 ? "\n" : ",\n", profile_out);
+				chip8_profile_write_json(&profile, path, 32, profile_out);
+			}
+			++profiled;
+		}
+#endif
+	}
+#ifdef CHIP8_PROFILE
+	if (profile_out != NULL)
+	{
+		if (!profile_csv)
+			fputs("\n]\n", profile_out);
+		if (profile_out != stdout && fclose(profile_out) != 0)
+		{
+			fprintf(stderr, "%s: cannot write profile\n", profile_path);
+			status = 1;
+		}
+	}
+#endif
+	return status;
+}
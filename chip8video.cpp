@@ -0,0 +1,222 @@
+#include "chip8video.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CHIP8VIDEO_X86
+#include <immintrin.h>
+#endif
+
+// A pixel lit in both cur and prev is white, lit in only one of them grey.
+// Plain conversion passes the same rows twice.
+static const uint16_t RGB565_GREY = 0x8410;
+static const uint32_t XRGB8888_GREY = 0xFF808080;
+
+typedef void (*rgb565_fn)(const uint64_t *cur, const uint64_t *prev, unsigned count, uint16_t *dst);
+typedef void (*xrgb8888_fn)(const uint64_t *cur, const uint64_t *prev, unsigned count, uint32_t *dst);
+
+static void rgb565_scalar(const uint64_t *cur, const uint64_t *prev, unsigned count, uint16_t *dst)
+{
+	for (unsigned y = 0; y < count; ++y)
+	{
+		uint64_t both = cur[y] & prev[y];
+		uint64_t either = cur[y] | prev[y];
+		for (int x = 63; x >= 0; --x)
+			*dst++ = (both >> x) & 1 ? 0xFFFF : (either >> x) & 1 ? RGB565_GREY : 0x0000;
+	}
+}
+
+static void xrgb8888_scalar(const uint64_t *cur, const uint64_t *prev, unsigned count, uint32_t *dst)
+{
+	for (unsigned y = 0; y < count; ++y)
+	{
+		uint64_t both = cur[y] & prev[y];
+		uint64_t either = cur[y] | prev[y];
+		for (int x = 63; x >= 0; --x)
+			*dst++ = (both >> x) & 1 ? 0xFFFFFFFF : (either >> x) & 1 ? XRGB8888_GREY : 0x00000000;
+	}
+}
+
+#ifdef CHIP8VIDEO_X86
+// Each lane tests one bit of a broadcast chunk of the row; cmpeq turns a set
+// bit into an all-ones (white) pixel, pixels set in only one row get grey.
+
+__attribute__((target("sse2")))
+static void rgb565_sse2(const uint64_t *cur, const uint64_t *prev, unsigned count, uint16_t *dst)
+{
+	const __m128i bits = _mm_setr_epi16(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+	const __m128i grey = _mm_set1_epi16((short)RGB565_GREY);
+	for (unsigned y = 0; y < count; ++y)
+	{
+		uint64_t a = cur[y], b = prev[y];
+		for (int shift = 56; shift >= 0; shift -= 8, dst += 8)
+		{
+			__m128i va = _mm_set1_epi16((short)((a >> shift) & 0xFF));
+			__m128i vb = _mm_set1_epi16((short)((b >> shift) & 0xFF));
+			va = _mm_cmpeq_epi16(_mm_and_si128(va, bits), bits);
+			vb = _mm_cmpeq_epi16(_mm_and_si128(vb, bits), bits);
+			__m128i v = _mm_or_si128(_mm_and_si128(va, vb), _mm_and_si128(_mm_or_si128(va, vb), grey));
+			_mm_storeu_si128((__m128i *)dst, v);
+		}
+	}
+}
+
+__attribute__((target("sse2")))
+static void xrgb8888_sse2(const uint64_t *cur, const uint64_t *prev, unsigned count, uint32_t *dst)
+{
+	const __m128i bits = _mm_setr_epi32(0x8, 0x4, 0x2, 0x1);
+	const __m128i grey = _mm_set1_epi32((int)XRGB8888_GREY);
+	for (unsigned y = 0; y < count; ++y)
+	{
+		uint64_t a = cur[y], b = prev[y];
+		for (int shift = 60; shift >= 0; shift -= 4, dst += 4)
+		{
+			__m128i va = _mm_set1_epi32((int)((a >> shift) & 0xF));
+			__m128i vb = _mm_set1_epi32((int)((b >> shift) & 0xF));
+			va = _mm_cmpeq_epi32(_mm_and_si128(va, bits), bits);
+			vb = _mm_cmpeq_epi32(_mm_and_si128(vb, bits), bits);
+			__m128i v = _mm_or_si128(_mm_and_si128(va, vb), _mm_and_si128(_mm_or_si128(va, vb), grey));
+			_mm_storeu_si128((__m128i *)dst, v);
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static void rgb565_avx2(const uint64_t *cur, const uint64_t *prev, unsigned count, uint16_t *dst)
+{
+	const __m256i bits = _mm256_setr_epi16(
+		(short)0x8000, 0x4000, 0x2000, 0x1000, 0x0800, 0x0400, 0x0200, 0x0100,
+		0x0080, 0x0040, 0x0020, 0x0010, 0x0008, 0x0004, 0x0002, 0x0001);
+	const __m256i grey = _mm256_set1_epi16((short)RGB565_GREY);
+	for (unsigned y = 0; y < count; ++y)
+	{
+		uint64_t a = cur[y], b = prev[y];
+		for (int shift = 48; shift >= 0; shift -= 16, dst += 16)
+		{
+			__m256i va = _mm256_set1_epi16((short)((a >> shift) & 0xFFFF));
+			__m256i vb = _mm256_set1_epi16((short)((b >> shift) & 0xFFFF));
+			va = _mm256_cmpeq_epi16(_mm256_and_si256(va, bits), bits);
+			vb = _mm256_cmpeq_epi16(_mm256_and_si256(vb, bits), bits);
+			__m256i v = _mm256_or_si256(_mm256_and_si256(va, vb), _mm256_and_si256(_mm256_or_si256(va, vb), grey));
+			_mm256_storeu_si256((__m256i *)dst, v);
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static void xrgb8888_avx2(const uint64_t *cur, const uint64_t *prev, unsigned count, uint32_t *dst)
+{
+	const __m256i bits = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+	const __m256i grey = _mm256_set1_epi32((int)XRGB8888_GREY);
+	for (unsigned y = 0; y < count; ++y)
+	{
+		uint64_t a = cur[y], b = prev[y];
+		for (int shift = 56; shift >= 0; shift -= 8, dst += 8)
+		{
+			__m256i va = _mm256_set1_epi32((int)((a >> shift) & 0xFF));
+			__m256i vb = _mm256_set1_epi32((int)((b >> shift) & 0xFF));
+			va = _mm256_cmpeq_epi32(_mm256_and_si256(va, bits), bits);
+			vb = _mm256_cmpeq_epi32(_mm256_and_si256(vb, bits), bits);
+			__m256i v = _mm256_or_si256(_mm256_and_si256(va, vb), _mm256_and_si256(_mm256_or_si256(va, vb), grey));
+			_mm256_storeu_si256((__m256i *)dst, v);
+		}
+	}
+}
+#endif
+
+static void rgb565_select(const uint64_t *cur, const uint64_t *prev, unsigned count, uint16_t *dst);
+static void xrgb8888_select(const uint64_t *cur, const uint64_t *prev, unsigned count, uint32_t *dst);
+
+static rgb565_fn rgb565_impl = rgb565_select;
+static xrgb8888_fn xrgb8888_impl = xrgb8888_select;
+static const char *backend = "scalar";
+
+static void select_backend()
+{
+	rgb565_impl = rgb565_scalar;
+	xrgb8888_impl = xrgb8888_scalar;
+	backend = "scalar";
+#ifdef CHIP8VIDEO_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		rgb565_impl = rgb565_avx2;
+		xrgb8888_impl = xrgb8888_avx2;
+		backend = "avx2";
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		rgb565_impl = rgb565_sse2;
+		xrgb8888_impl = xrgb8888_sse2;
+		backend = "sse2";
+	}
+#endif
+}
+
+static void rgb565_select(const uint64_t *cur, const uint64_t *prev, unsigned count, uint16_t *dst)
+{
+	select_backend();
+	rgb565_impl(cur, prev, count, dst);
+}
+
+static void xrgb8888_select(const uint64_t *cur, const uint64_t *prev, unsigned count, uint32_t *dst)
+{
+	select_backend();
+	xrgb8888_impl(cur, prev, count, dst);
+}
+
+void chip8video_to_rgb565(const uint64_t *rows, unsigned count, uint16_t *dst)
+{
+	rgb565_impl(rows, rows, count, dst);
+}
+
+void chip8video_to_xrgb8888(const uint64_t *rows, unsigned count, uint32_t *dst)
+{
+	xrgb8888_impl(rows, rows, count, dst);
+}
+
+void chip8video_blend_rgb565(const uint64_t *cur, const uint64_t *prev, unsigned count, uint16_t *dst)
+{
+	rgb565_impl(cur, prev, count, dst);
+}
+
+void chip8video_blend_xrgb8888(const uint64_t *cur, const uint64_t *prev, unsigned count, uint32_t *dst)
+{
+	xrgb8888_impl(cur, prev, count, dst);
+}
+
+// Each run of consecutive dirty rows is converted with one kernel call.
+void chip8video_update_rgb565(const uint64_t *cur, const uint64_t *prev, uint32_t rowmask, uint16_t *dst)
+{
+	unsigned y = 0;
+	while (rowmask != 0)
+	{
+		unsigned skip = __builtin_ctz(rowmask);
+		rowmask >>= skip;
+		y += skip;
+		unsigned count = rowmask == 0xFFFFFFFF ? 32 : __builtin_ctz(~rowmask);
+		rgb565_impl(cur + y, prev + y, count, dst + y * 64);
+		rowmask = count < 32 ? rowmask >> count : 0;
+		y += count;
+	}
+}
+
+void chip8video_update_xrgb8888(const uint64_t *cur, const uint64_t *prev, uint32_t rowmask, uint32_t *dst)
+{
+	unsigned y = 0;
+	while (rowmask != 0)
+	{
+		unsigned skip = __builtin_ctz(rowmask);
+		rowmask >>= skip;
+		y += skip;
+		unsigned count = rowmask == 0xFFFFFFFF ? 32 : __builtin_ctz(~rowmask);
+		xrgb8888_impl(cur + y, prev + y, count, dst + y * 64);
+		rowmask = count < 32 ? rowmask >> count : 0;
+		y += count;
+	}
+}
+
+const char *chip8video_backend()
+{
+	if (rgb565_impl == rgb565_select)
+		select_backend();
+	return backend;
+}
@@ -0,0 +1,26 @@
+#ifndef CHIP8VIDEO_H
+#define CHIP8VIDEO_H
+
+#include <stdint.h>
+
+// Expands packed display rows (one uint64_t per 64 pixel row, MSB first) into
+// frontend pixel formats. Lit pixels become white, unlit ones black.
+// The fastest implementation the host CPU supports (AVX2, SSE2 or scalar) is
+// picked on first use.
+
+void chip8video_to_rgb565(const uint64_t *rows, unsigned count, uint16_t *dst);
+void chip8video_to_xrgb8888(const uint64_t *rows, unsigned count, uint32_t *dst);
+
+// Flicker reduction: pixels lit in both frames are white, pixels lit in only
+// one of them are drawn at half intensity.
+void chip8video_blend_rgb565(const uint64_t *cur, const uint64_t *prev, unsigned count, uint16_t *dst);
+void chip8video_blend_xrgb8888(const uint64_t *cur, const uint64_t *prev, unsigned count, uint32_t *dst);
+
+// Partial update of a full SCREEN_X wide frame: only rows whose bit is set in
+// rowmask are converted (blended like above), the rest of dst is left alone.
+void chip8video_update_rgb565(const uint64_t *cur, const uint64_t *prev, uint32_t rowmask, uint16_t *dst);
+void chip8video_update_xrgb8888(const uint64_t *cur, const uint64_t *prev, uint32_t rowmask, uint32_t *dst);
+
+const char *chip8video_backend();
+
+#endif
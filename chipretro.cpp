@@ -5,19 +5,65 @@
 #include <stdarg.h>
 #include <string.h>
 #include <math.h>
+#include <type_traits>
 
 #include "libretro.h"
 #include "chip8.h"
-
-static uint16_t fb[2048];
-static retro_usec_t frame_time;
-static retro_usec_t time_reference;
-static retro_usec_t total_time;
+#include "chip8video.h"
+#include "chip8rewind.h"
+#include "chip8log.h"
+#include "chip8romlib.h"
+#ifdef CHIP8_JIT
+#include "chip8jit.h"
+#endif
+#ifdef CHIP8_PERF
+#include "chip8perf.h"
+#endif
+
+// Everything one running game owns, in one trivially copyable block: another
+// instance is another retro_core, a clone is a memcpy. The rewind buffer and
+// the JIT hold heap and executable memory and only exist when enabled, so they
+// stay outside next to the frontend callbacks and the log ring.
+struct retro_core
+{
+	chip8 emu;
+	uint16_t fb[SCREEN_X * SCREEN_Y];
+	uint32_t fb32[SCREEN_X * SCREEN_Y];
+	enum retro_pixel_format pixel_format;
+	uint64_t prev_gfx[SCREEN_Y];	// display at the end of the previous retro_run
+	uint32_t prev_dirty;			// rows that changed during the previous retro_run
+	bool full_redraw;				// convert every row on the next present
+	uint32_t extra_dirty;			// rows to convert on the next present besides the emulator's own
+	unsigned ipf;					// instructions per frame, the timers tick once per frame
+	unsigned runahead_frames;
+	chip8_savestate runahead_state;
+	bool rewinding;
+	bool can_dupe;
+	bool flicker_reduction;
+	retro_usec_t frame_time;
+	retro_usec_t time_reference;
+	retro_usec_t total_time;
+};
+
+static_assert(std::is_trivially_copyable<retro_core>::value, "retro_core must stay clonable with memcpy");
+
+static retro_core core;
+static chip8rewind rewind_buffer;
+static const size_t REWIND_CAPACITY = 4 * 1024 * 1024;
+static const unsigned MAX_CATCHUP_FRAMES = 4;	// frames run in one retro_run to catch up, more are dropped
 static struct retro_log_callback logging;
 static retro_log_printf_t log_cb;
-std::clock_t start;
 
-static chip8 emu;
+#ifdef CHIP8_JIT
+static chip8jit jit;
+#endif
+#ifdef CHIP8_ASYNC_LOG
+static chip8logring log_ring;
+#endif
+#ifdef CHIP8_PERF
+static chip8perf perf;
+static const uint64_t PERF_REPORT_FRAMES = 600;	// emulated frames between reports
+#endif
 
 static void fallback_log(enum retro_log_level level, const char *fmt, ...)
 {
@@ -30,12 +76,16 @@ static void fallback_log(enum retro_log_level level, const char *fmt, ...)
 
 void retro_init(void)
 {
-    memset(fb,0,sizeof(fb));
+    memset(core.fb,0,sizeof(core.fb));
+    memset(core.fb32,0,sizeof(core.fb32));
 }
 
 void retro_deinit(void)
 {
-	
+#ifdef CHIP8_ASYNC_LOG
+	core.emu.setLogRing(NULL);
+	log_ring.stop();
+#endif
 }
 
 unsigned retro_api_version(void)
@@ -86,17 +136,30 @@ void retro_set_environment(retro_environment_t cb)
 	bool no_content = true;
 	cb(RETRO_ENVIRONMENT_SET_SUPPORT_NO_GAME, &no_content);
 
+	static const struct retro_variable vars[] = {
+		{ "chip8_flicker_reduction", "Flicker reduction; disabled|enabled" },
+		{ "chip8_ipf", "Instructions per frame; 10|7|8|9|11|12|15|20|30|50|100|200|500|1000|10000|100000" },
+		{ "chip8_runahead", "Run-ahead frames; 0|1|2|3" },
+		{ "chip8_rewind", "Rewind (hold Backspace); disabled|enabled" },
+		{ NULL, NULL },
+	};
+	cb(RETRO_ENVIRONMENT_SET_VARIABLES, (void*)vars);
+
 	if (cb(RETRO_ENVIRONMENT_GET_LOG_INTERFACE, &logging))
 		log_cb = logging.log;
 	else
 		log_cb = fallback_log;
 
-	emu.setLogger((void*)log_cb);
+	core.emu.setLogger((void*)log_cb);
+#ifdef CHIP8_ASYNC_LOG
+	if (log_ring.start(reinterpret_cast<chip8_log_cb>(log_cb)))
+		core.emu.setLogRing(&log_ring);
+#endif
 }
 
 static void frame_time_cb(retro_usec_t usec)
 {
-	frame_time = usec;
+	core.frame_time = usec;
 }
 
 void retro_set_audio_sample(retro_audio_sample_t cb)
@@ -129,32 +192,131 @@ void retro_reset(void)
 
 }
 
-static void update_input(void)
+static void update_input(retro_core &c)
 {
 	input_poll_cb();
-	emu.keypad[0x1] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_1) ? 1 : 0;
-	emu.keypad[0x2] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_2) ? 1 : 0;
-	emu.keypad[0x3] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_3) ? 1 : 0;
-	emu.keypad[0xC] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_4) ? 1 : 0;
+	c.emu.keypad[0x1] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_1) ? 1 : 0;
+	c.emu.keypad[0x2] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_2) ? 1 : 0;
+	c.emu.keypad[0x3] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_3) ? 1 : 0;
+	c.emu.keypad[0xC] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_4) ? 1 : 0;
+
+	c.emu.keypad[0x4] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_b) ? 1 : 0;
+	c.emu.keypad[0x5] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_n) ? 1 : 0;
+	c.emu.keypad[0x6] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_m) ? 1 : 0;
+	c.emu.keypad[0xD] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_r) ? 1 : 0;
+
+	c.emu.keypad[0x7] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_a) ? 1 : 0;
+	c.emu.keypad[0x8] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_s) ? 1 : 0;
+	c.emu.keypad[0x9] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_d) ? 1 : 0;
+	c.emu.keypad[0xE] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_f) ? 1 : 0;
+
+	c.emu.keypad[0xA] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_z) ? 1 : 0;
+	c.emu.keypad[0x0] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_x) ? 1 : 0;
+	c.emu.keypad[0xB] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_c) ? 1 : 0;
+	c.emu.keypad[0xF] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_v) ? 1 : 0;
+
+	c.rewinding = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_BACKSPACE) != 0;
+}
+
+static void check_variables(retro_core &c)
+{
+	struct retro_variable var = { "chip8_flicker_reduction", NULL };
+	c.flicker_reduction = environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && strcmp(var.value, "enabled") == 0;
+
+	var.key = "chip8_ipf";
+	var.value = NULL;
+	c.ipf = 10;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && atoi(var.value) > 0)
+		c.ipf = atoi(var.value);
+
+	var.key = "chip8_runahead";
+	var.value = NULL;
+	c.runahead_frames = 0;
+	if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+		c.runahead_frames = atoi(var.value);
+
+	var.key = "chip8_rewind";
+	var.value = NULL;
+	bool rewind_enabled = environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && strcmp(var.value, "enabled") == 0;
+	if (rewind_enabled && !rewind_buffer.initialized())
+		rewind_buffer.init(REWIND_CAPACITY);
+	else if (!rewind_enabled)
+		rewind_buffer.deinit();
+
+	c.full_redraw = true;
+}
 
-	emu.keypad[0x4] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_b) ? 1 : 0;
-	emu.keypad[0x5] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_n) ? 1 : 0;
-	emu.keypad[0x6] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_m) ? 1 : 0;
-	emu.keypad[0xD] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_r) ? 1 : 0;
+// Called exactly once per retro_run, after all draws of the frame are done.
+// Only rows the emulator marked dirty are converted.
+static void present_frame(retro_core &c)
+{
+	uint32_t dirty = c.emu.getDirtyRows() | c.extra_dirty;
+	c.emu.clearDirtyRows();
+	c.extra_dirty = 0;
 
-	emu.keypad[0x7] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_a) ? 1 : 0;
-	emu.keypad[0x8] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_s) ? 1 : 0;
-	emu.keypad[0x9] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_d) ? 1 : 0;
-	emu.keypad[0xE] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_f) ? 1 : 0;
+	const uint64_t *prev = c.emu.gfx;
+	uint32_t rows = dirty;
+	if (c.flicker_reduction)
+	{
+		prev = c.prev_gfx;
+		rows |= c.prev_dirty; // the blend also changes where the previous frame did
+	}
+	if (c.full_redraw)
+		rows = 0xFFFFFFFF;
+	c.prev_dirty = dirty;
 
-	emu.keypad[0xA] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_z) ? 1 : 0;
-	emu.keypad[0x0] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_x) ? 1 : 0;
-	emu.keypad[0xB] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_c) ? 1 : 0;
-	emu.keypad[0xF] = input_state_cb(0, RETRO_DEVICE_KEYBOARD, 0, RETROK_v) ? 1 : 0;
+	unsigned pitch = SCREEN_X * (c.pixel_format == RETRO_PIXEL_FORMAT_XRGB8888 ? sizeof(uint32_t) : sizeof(uint16_t));
+	if (rows == 0 && c.can_dupe)
+	{
+		video_cb(NULL, SCREEN_X, SCREEN_Y, pitch); // nothing changed, let the frontend reuse the last frame
+	}
+	else if (c.pixel_format == RETRO_PIXEL_FORMAT_XRGB8888)
+	{
+		chip8video_update_xrgb8888(c.emu.gfx, prev, rows, c.fb32);
+		video_cb(c.fb32, SCREEN_X, SCREEN_Y, pitch);
+	}
+	else
+	{
+		chip8video_update_rgb565(c.emu.gfx, prev, rows, c.fb);
+		video_cb(c.fb, SCREEN_X, SCREEN_Y, pitch); // 16bpp works
+	}
+	c.full_redraw = false;
+
+	memcpy(c.prev_gfx, c.emu.gfx, sizeof(c.prev_gfx));
 }
 
-static void check_variables(void)
+static void emulate_frame(retro_core &c)
 {
+#ifdef CHIP8_JIT
+	jit.runFrame(c.emu, c.ipf);
+#else
+	c.emu.runFrame(c.ipf);
+#endif
+	c.emu.drawFlag = false; // draws are composed and presented once per retro_run
+#ifdef CHIP8_PERF
+	perf.addWork(1, c.ipf);
+#endif
+}
+
+// The frame just emulated is the real one. Snapshot it, emulate runahead_frames
+// more with the same input, show the last of them and roll back. Only that last
+// frame is converted and handed to video_cb.
+static void run_ahead(retro_core &c)
+{
+	c.emu.serialize(&c.runahead_state, sizeof(c.runahead_state));
+	uint32_t committed = c.emu.getDirtyRows();
+	c.emu.clearDirtyRows();
+
+	for (unsigned i = 0; i < c.runahead_frames; ++i)
+		emulate_frame(c);
+	uint32_t ahead = c.emu.getDirtyRows();
+
+	c.extra_dirty |= committed;
+	present_frame(c);
+
+	c.emu.unserialize(&c.runahead_state, sizeof(c.runahead_state));
+	c.emu.clearDirtyRows();
+	c.extra_dirty = ahead; // the shown frame may differ from the restored one in these rows
 }
 
 static void audio_callback(void)
@@ -162,65 +324,114 @@ static void audio_callback(void)
 	audio_cb(1,1);
 }
 
+#ifdef CHIP8_PERF
+static void perf_report(void)
+{
+	if (perf.frames() == 0)
+		return;
+	char text[512];
+	perf.format(text, sizeof(text));
+	log_cb(RETRO_LOG_INFO, "perf over %llu frames: %s\n", (unsigned long long)perf.frames(), text);
+	perf.reset();
+}
+#endif
+
 void retro_run(void)
 {
-		update_input();
+#ifdef CHIP8_PERF
+		perf.start();
+#endif
+		update_input(core);
 
-		if (frame_time < (time_reference >> 1))
-			total_time += frame_time;
+		if (core.frame_time < (core.time_reference >> 1))
+			core.total_time += core.frame_time;
 		else
-			total_time += ((frame_time + (time_reference >> 1)) / time_reference) * time_reference;
-		int frames = (total_time + (time_reference >> 1)) / time_reference;
+			core.total_time += ((core.frame_time + (core.time_reference >> 1)) / core.time_reference) * core.time_reference;
+		unsigned frames = (unsigned)(core.total_time / core.time_reference);
+		core.total_time -= frames * core.time_reference;
+		if (frames > MAX_CATCHUP_FRAMES)
+			frames = MAX_CATCHUP_FRAMES; // after a stall, don't fast-forward through what was missed
 
-		if (frames <= 0)
+		if (frames > 0 && core.rewinding && !rewind_buffer.empty())
 		{
-			video_cb(fb, SCREEN_X, SCREEN_Y, SCREEN_X << 1);
+			uint8_t keypad[16];
+			memcpy(keypad, core.emu.keypad, sizeof(keypad)); // keep live input, the snapshot has the recorded one
+			for (unsigned i = 0; i < frames && !rewind_buffer.empty(); ++i)
+				rewind_buffer.stepBack(core.emu);
+			memcpy(core.emu.keypad, keypad, sizeof(keypad));
+			present_frame(core);
 		}
-
-		else if (total_time > time_reference)
-		{			
-			for (int i = 0; i < 10; ++i)
+		else if (frames > 0)
+		{
+			for (unsigned i = 0; i < frames; ++i)
 			{
-				emu.emulateCycle();
-				if (emu.drawFlag)
-				{
-                    for (int i=0; i < 2048; ++i)
-                        fb[i] = emu.gfx[i] == 1 ?  0xFFFF : 0x0000;
-					video_cb(fb, SCREEN_X, SCREEN_Y, SCREEN_X << 1); // 16bpp works
-					emu.drawFlag ^= emu.drawFlag;
-				}
+				emulate_frame(core);
+				rewind_buffer.push(core.emu);
 			}
-
-			total_time = 0;
+			if (core.runahead_frames > 0)
+				run_ahead(core);
+			else
+				present_frame(core);
+		}
+		else
+		{
+			present_frame(core);
 		}
 
 		audio_callback(); // nothing
 
 		bool updated = false;
 		if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &updated) && updated)
-			check_variables();
-		if (!emu.run)
+			check_variables(core);
+		if (!core.emu.run)
 			environ_cb(RETRO_ENVIRONMENT_SHUTDOWN, NULL);
+#ifdef CHIP8_PERF
+		perf.stop();
+		if (perf.frames() >= PERF_REPORT_FRAMES)
+			perf_report();
+#endif
 }
 
 bool retro_load_game(const struct retro_game_info *info)
 {
-	enum retro_pixel_format fmt = RETRO_PIXEL_FORMAT_RGB565;
-	if (!environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt))
+	core.pixel_format = RETRO_PIXEL_FORMAT_RGB565;
+	if (!environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &core.pixel_format))
 	{
-		log_cb(RETRO_LOG_INFO, "RGB565 is not supported.\n");
-		return false;
+		log_cb(RETRO_LOG_INFO, "RGB565 is not supported, trying XRGB8888.\n");
+		core.pixel_format = RETRO_PIXEL_FORMAT_XRGB8888;
+		if (!environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &core.pixel_format))
+		{
+			log_cb(RETRO_LOG_INFO, "XRGB8888 is not supported.\n");
+			return false;
+		}
 	}
-
-	time_reference = 1000000 / 60; // some arbitrary value which works for whatever reason
-	struct retro_frame_time_callback frame_cb = { frame_time_cb, time_reference };
+	log_cb(RETRO_LOG_INFO, "Video conversion: %s\n", chip8video_backend());
+#ifdef CHIP8_JIT
+	if (!jit.init())
+		log_cb(RETRO_LOG_WARN, "JIT unavailable, interpreting.\n");
+#endif
+
+	if (!environ_cb(RETRO_ENVIRONMENT_GET_CAN_DUPE, &core.can_dupe))
+		core.can_dupe = false;
+	core.full_redraw = true;
+
+	core.time_reference = 1000000 / 60; // some arbitrary value which works for whatever reason
+	struct retro_frame_time_callback frame_cb = { frame_time_cb, core.time_reference };
 	if (!environ_cb(RETRO_ENVIRONMENT_SET_FRAME_TIME_CALLBACK, &frame_cb))
 	{
 		log_cb(RETRO_LOG_INFO, "Failed to set frame time callback.\n");
 		return false;
 	}
 
-	check_variables();
+	check_variables(core);
+
+#ifdef CHIP8_PERF
+	unsigned counters = perf.open();
+	if (counters == 0)
+		log_cb(RETRO_LOG_WARN, "Hardware counters unavailable (%s), not measuring.\n", perf.error());
+	else if (counters < chip8perf::COUNTERS)
+		log_cb(RETRO_LOG_WARN, "Some hardware counters unavailable (%s).\n", perf.error());
+#endif
 
 	if (info == NULL)
 	{
@@ -228,14 +439,44 @@ bool retro_load_game(const struct retro_game_info *info)
 		return true;
 	}
 
-	emu.loadApplication(info->data, info->size);
+	// A chip8pack archive as content runs the entry its meta string names, by
+	// file name or XXH64, else the first one in hash order.
+	const void *data = info->data;
+	size_t size = info->size;
+	chip8romlib archive;
+	if (chip8romlib::isArchive(info->data, info->size))
+	{
+		bool named = info->meta != NULL && info->meta[0] != '\0';
+		const chip8romlib::entry *rom = NULL;
+		if (archive.attach(info->data, info->size) && archive.size() > 0)
+			rom = named ? archive.lookup(info->meta) : &archive.rom(0);
+		if (rom == NULL)
+		{
+			log_cb(RETRO_LOG_ERROR, "No ROM %s in archive.\n", named ? info->meta : "");
+			return false;
+		}
+		log_cb(RETRO_LOG_INFO, "Archive entry %s (%016llx).\n", rom->name, (unsigned long long)rom->hash);
+		data = rom->data;
+		size = rom->size;
+	}
+
+	core.emu.setSeed((uint32_t)time(NULL)); // a new CXNN sequence every session, savestates carry it from there
+	core.emu.loadApplication(data, size);
 
 	return true;
 }
 
 void retro_unload_game(void)
 {
-	emu.Reset();
+#ifdef CHIP8_PERF
+	perf_report();
+	perf.close();
+#endif
+	core.emu.Reset();
+	rewind_buffer.clear();
+#ifdef CHIP8_JIT
+	jit.deinit();
+#endif
 }
 
 unsigned retro_get_region(void)
@@ -250,23 +491,26 @@ bool retro_load_game_special(unsigned type, const struct retro_game_info *info,
 
 size_t retro_serialize_size(void)
 {
-	return 0;
+	return chip8::serializeSize();
 }
 
 bool retro_serialize(void *data_, size_t size)
 {	
-	return false;
+	return core.emu.serialize(data_, size);
 }
 
 bool retro_unserialize(const void *data_, size_t size)
 {
-	return false;
+	if (!core.emu.unserialize(data_, size))
+		return false;
+	core.full_redraw = true;
+	return true;
 }
 
 void *retro_get_memory_data(unsigned id)
 {
 	if (id == RETRO_MEMORY_SYSTEM_RAM)
-		return emu.getMemory();
+		return core.emu.getMemory();
 	return NULL;
 }
 